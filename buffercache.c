@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "softwaredisk.h"
+#include "buffercache.h"
+
+// a cache always holds at least this many blocks, whatever the budget
+#define MIN_CACHE_BLOCKS 16
+
+/////////////////////////////// HELPER FUNCTIONS ///////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// return the hash bucket of blocknum
+static int bucket_of(BufferCache *cache, unsigned long blocknum)
+{
+    return (int)((blocknum * 2654435761UL) & (cache->num_buckets - 1));
+}
+
+// return the data of entry at index
+static char *entry_data(BufferCache *cache, int index)
+{
+    return cache->data + (size_t)index * cache->block_size;
+}
+
+// return the index of the entry holding blocknum, -1 when not cached
+static int lookup(BufferCache *cache, unsigned long blocknum)
+{
+    int index = cache->buckets[bucket_of(cache, blocknum)];
+    while (index != -1 && cache->entries[index].blocknum != (long)blocknum)
+    {
+        index = cache->entries[index].hash_next;
+    }
+    return index;
+}
+
+static void hash_insert(BufferCache *cache, int index)
+{
+    int bucket = bucket_of(cache, cache->entries[index].blocknum);
+    cache->entries[index].hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = index;
+}
+
+static void hash_remove(BufferCache *cache, int index)
+{
+    int *link = &cache->buckets[bucket_of(cache, cache->entries[index].blocknum)];
+    while (*link != index)
+    {
+        link = &cache->entries[*link].hash_next;
+    }
+    *link = cache->entries[index].hash_next;
+}
+
+static void lru_unlink(BufferCache *cache, int index)
+{
+    BCEntry *entry = &cache->entries[index];
+    if (entry->prev != -1)
+        cache->entries[entry->prev].next = entry->next;
+    else
+        cache->lru_head = entry->next;
+    if (entry->next != -1)
+        cache->entries[entry->next].prev = entry->prev;
+    else
+        cache->lru_tail = entry->prev;
+}
+
+static void lru_push_front(BufferCache *cache, int index)
+{
+    BCEntry *entry = &cache->entries[index];
+    entry->prev = -1;
+    entry->next = cache->lru_head;
+    if (cache->lru_head != -1)
+        cache->entries[cache->lru_head].prev = index;
+    cache->lru_head = index;
+    if (cache->lru_tail == -1)
+        cache->lru_tail = index;
+}
+
+// record a use of the entry at index for the replacement policy
+static void touch(BufferCache *cache, int index)
+{
+    if (cache->policy == BC_CLOCK)
+        cache->entries[index].referenced = 1;
+    else if (cache->lru_head != index)
+    {
+        lru_unlink(cache, index);
+        lru_push_front(cache, index);
+    }
+}
+
+// pick the entry to reuse according to the replacement policy, passing over
+// pinned entries; at most half the entries are pinned
+static int pick_victim(BufferCache *cache)
+{
+    if (cache->policy == BC_LRU)
+    {
+        int index = cache->lru_tail;
+        while (cache->entries[index].pins > 0)
+        {
+            index = cache->entries[index].prev;
+        }
+        return index;
+    }
+
+    while (cache->entries[cache->clock_hand].referenced || cache->entries[cache->clock_hand].pins > 0)
+    {
+        cache->entries[cache->clock_hand].referenced = 0;
+        cache->clock_hand = (cache->clock_hand + 1) % cache->capacity;
+    }
+    int victim = cache->clock_hand;
+    cache->clock_hand = (cache->clock_hand + 1) % cache->capacity;
+    return victim;
+}
+
+// get an entry for blocknum, which must not be cached yet, evicting a block when
+// the cache is full. A dirty victim triggers a write back of every dirty block so
+// that write back happens in large sorted batches. Return -1 on error
+static int allocate_entry(BufferCache *cache, unsigned long blocknum)
+{
+    int index;
+    if (cache->num_used < cache->capacity)
+    {
+        index = cache->num_used++;
+        if (cache->policy == BC_LRU)
+            lru_push_front(cache, index);
+    }
+    else
+    {
+        index = pick_victim(cache);
+        if (cache->entries[index].dirty && !flush_cache(cache))
+            return -1;
+        hash_remove(cache, index);
+        cache->stats.evictions++;
+        if (cache->policy == BC_LRU)
+        {
+            lru_unlink(cache, index);
+            lru_push_front(cache, index);
+        }
+    }
+    cache->entries[index].blocknum = blocknum;
+    cache->entries[index].dirty = 0;
+    cache->entries[index].referenced = 1;
+    hash_insert(cache, index);
+    return index;
+}
+
+static int compare_blocknum(const void *a, const void *b)
+{
+    unsigned long x = ((const SDBlockIO *)a)->blocknum;
+    unsigned long y = ((const SDBlockIO *)b)->blocknum;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+////////////// CACHE OPERATIONS DEFINITION //////////////
+
+int init_cache(BufferCache *cache, SoftwareDisk disk, unsigned long budget, BCPolicy policy, int block_size)
+{
+    free_cache(cache);
+    if (block_size <= 0)
+        return 0;
+
+    cache->disk = disk;
+    cache->block_size = block_size;
+    cache->policy = policy;
+    cache->capacity = budget / block_size;
+    if (cache->capacity < MIN_CACHE_BLOCKS)
+        cache->capacity = MIN_CACHE_BLOCKS;
+    cache->num_buckets = 1;
+    while (cache->num_buckets < 2 * cache->capacity)
+    {
+        cache->num_buckets *= 2;
+    }
+
+    cache->entries = malloc(cache->capacity * sizeof(BCEntry));
+    cache->data = malloc((size_t)cache->capacity * block_size);
+    cache->buckets = malloc(cache->num_buckets * sizeof(int));
+    if (cache->entries == NULL || cache->data == NULL || cache->buckets == NULL)
+    {
+        free_cache(cache);
+        return 0;
+    }
+    for (int i = 0; i < cache->num_buckets; i++)
+    {
+        cache->buckets[i] = -1;
+    }
+    for (int i = 0; i < cache->capacity; i++)
+    {
+        cache->entries[i].blocknum = -1;
+        cache->entries[i].dirty = 0;
+        cache->entries[i].referenced = 0;
+        cache->entries[i].pins = 0;
+    }
+    cache->num_used = 0;
+    cache->num_pinned = 0;
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+    cache->clock_hand = 0;
+    memset(&cache->stats, 0, sizeof(BCStats));
+    return 1;
+}
+
+void free_cache(BufferCache *cache)
+{
+    free(cache->entries);
+    free(cache->data);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->data = NULL;
+    cache->buckets = NULL;
+    cache->capacity = 0;
+    cache->num_used = 0;
+    cache->num_pinned = 0;
+}
+
+int read_cache_block(BufferCache *cache, void *buf, unsigned long blocknum)
+{
+    int index = lookup(cache, blocknum);
+    if (index != -1)
+    {
+        cache->stats.hits++;
+        touch(cache, index);
+        memcpy(buf, entry_data(cache, index), cache->block_size);
+        return 1;
+    }
+
+    cache->stats.misses++;
+    if (!sd_read_block(cache->disk, buf, blocknum))
+        return 0;
+    index = allocate_entry(cache, blocknum);
+    if (index == -1)
+        return 0;
+    memcpy(entry_data(cache, index), buf, cache->block_size);
+    return 1;
+}
+
+int write_cache_block(BufferCache *cache, void *buf, unsigned long blocknum)
+{
+    if (blocknum >= sd_size(cache->disk))
+    {
+        sderror = SD_ILLEGAL_BLOCK_NUMBER;
+        return 0;
+    }
+    int index = lookup(cache, blocknum);
+    if (index != -1)
+        touch(cache, index);
+    else
+    {
+        index = allocate_entry(cache, blocknum);
+        if (index == -1)
+            return 0;
+    }
+    memcpy(entry_data(cache, index), buf, cache->block_size);
+    cache->entries[index].dirty = 1;
+    return 1;
+}
+
+int read_cache_blocks(BufferCache *cache, SDBlockIO *ios, unsigned long count)
+{
+    // serve hits from the cache, collect the misses
+    SDBlockIO *misses = malloc(count * sizeof(SDBlockIO));
+    if (misses == NULL)
+        return 0;
+    unsigned long num_misses = 0;
+    for (unsigned long i = 0; i < count; i++)
+    {
+        int index = lookup(cache, ios[i].blocknum);
+        if (index != -1)
+        {
+            cache->stats.hits++;
+            touch(cache, index);
+            memcpy(ios[i].buf, entry_data(cache, index), cache->block_size);
+        }
+        else
+        {
+            cache->stats.misses++;
+            misses[num_misses++] = ios[i];
+        }
+    }
+
+    // read the misses straight into the caller's buffers, then keep a copy
+    int success = 1;
+    if (num_misses > 0)
+        success = sd_read_blocks(cache->disk, misses, num_misses);
+    for (unsigned long i = 0; success && i < num_misses; i++)
+    {
+        if (lookup(cache, misses[i].blocknum) != -1)
+            continue;
+        int index = allocate_entry(cache, misses[i].blocknum);
+        if (index == -1)
+            success = 0;
+        else
+            memcpy(entry_data(cache, index), misses[i].buf, cache->block_size);
+    }
+    free(misses);
+    return success;
+}
+
+int prefetch_cache_blocks(BufferCache *cache, unsigned long *blocknums, unsigned long count)
+{
+    // the blocks not cached yet are read into a scratch buffer, then cached
+    SDBlockIO *misses = malloc(count * sizeof(SDBlockIO));
+    char *scratch = malloc(count * cache->block_size);
+    if (misses == NULL || scratch == NULL)
+    {
+        free(misses);
+        free(scratch);
+        return 0;
+    }
+    unsigned long num_misses = 0;
+    for (unsigned long i = 0; i < count; i++)
+    {
+        if (lookup(cache, blocknums[i]) != -1)
+            continue;
+        misses[num_misses].blocknum = blocknums[i];
+        misses[num_misses].buf = scratch + num_misses * cache->block_size;
+        num_misses++;
+    }
+
+    int success = 1;
+    if (num_misses > 0)
+        success = sd_read_blocks(cache->disk, misses, num_misses);
+    for (unsigned long i = 0; success && i < num_misses; i++)
+    {
+        if (lookup(cache, misses[i].blocknum) != -1)
+            continue;
+        int index = allocate_entry(cache, misses[i].blocknum);
+        if (index == -1)
+            success = 0;
+        else
+        {
+            memcpy(entry_data(cache, index), misses[i].buf, cache->block_size);
+            cache->stats.prefetches++;
+        }
+    }
+    free(misses);
+    free(scratch);
+    return success;
+}
+
+int pin_cache_blocks(BufferCache *cache, unsigned long *blocknums, unsigned long count, char **data)
+{
+    if (cache->num_pinned + count > (unsigned long)cache->capacity / 2)
+        return 0;
+
+    // pin the hits, collect the misses
+    SDBlockIO *misses = malloc(count * sizeof(SDBlockIO));
+    char *scratch = malloc(count * cache->block_size);
+    if (misses == NULL || scratch == NULL)
+    {
+        free(misses);
+        free(scratch);
+        return 0;
+    }
+    unsigned long num_misses = 0;
+    for (unsigned long i = 0; i < count; i++)
+    {
+        int index = lookup(cache, blocknums[i]);
+        if (index != -1)
+        {
+            cache->stats.hits++;
+            touch(cache, index);
+            cache->entries[index].pins++;
+            cache->num_pinned++;
+            data[i] = entry_data(cache, index);
+        }
+        else
+        {
+            cache->stats.misses++;
+            data[i] = NULL;
+            misses[num_misses].blocknum = blocknums[i];
+            misses[num_misses].buf = scratch + num_misses * cache->block_size;
+            num_misses++;
+        }
+    }
+
+    // then cache and pin the misses
+    int success = 1;
+    if (num_misses > 0)
+        success = sd_read_blocks(cache->disk, misses, num_misses);
+    for (unsigned long i = 0, k = 0; success && i < count; i++)
+    {
+        if (data[i] != NULL)
+            continue;
+        int index = lookup(cache, blocknums[i]);
+        if (index == -1)
+        {
+            index = allocate_entry(cache, blocknums[i]);
+            if (index == -1)
+            {
+                success = 0;
+                break;
+            }
+            memcpy(entry_data(cache, index), misses[k].buf, cache->block_size);
+        }
+        k++;
+        cache->entries[index].pins++;
+        cache->num_pinned++;
+        data[i] = entry_data(cache, index);
+    }
+    if (!success)
+    {
+        for (unsigned long i = 0; i < count; i++)
+        {
+            if (data[i] != NULL)
+                unpin_cache_block(cache, blocknums[i]);
+        }
+    }
+    free(misses);
+    free(scratch);
+    return success;
+}
+
+void unpin_cache_block(BufferCache *cache, unsigned long blocknum)
+{
+    int index = lookup(cache, blocknum);
+    if (index != -1 && cache->entries[index].pins > 0)
+    {
+        cache->entries[index].pins--;
+        cache->num_pinned--;
+    }
+}
+
+int write_cache_blocks(BufferCache *cache, SDBlockIO *ios, unsigned long count)
+{
+    int success = 1;
+    for (unsigned long i = 0; success && i < count; i++)
+    {
+        success = write_cache_block(cache, ios[i].buf, ios[i].blocknum);
+    }
+    return success;
+}
+
+int flush_cache(BufferCache *cache)
+{
+    int num_dirty = 0;
+    for (int i = 0; i < cache->num_used; i++)
+    {
+        if (cache->entries[i].dirty)
+            num_dirty++;
+    }
+    if (num_dirty == 0)
+        return 1;
+
+    SDBlockIO *ios = malloc(num_dirty * sizeof(SDBlockIO));
+    if (ios == NULL)
+        return 0;
+    int k = 0;
+    for (int i = 0; i < cache->num_used; i++)
+    {
+        if (cache->entries[i].dirty)
+        {
+            ios[k].blocknum = cache->entries[i].blocknum;
+            ios[k].buf = entry_data(cache, i);
+            k++;
+        }
+    }
+
+    // in block order so that runs of consecutive blocks merge into one write
+    qsort(ios, num_dirty, sizeof(SDBlockIO), compare_blocknum);
+    int success = sd_write_blocks(cache->disk, ios, num_dirty);
+    if (success)
+    {
+        for (int i = 0; i < cache->num_used; i++)
+        {
+            cache->entries[i].dirty = 0;
+        }
+        cache->stats.writebacks += num_dirty;
+    }
+    free(ios);
+    return success;
+}
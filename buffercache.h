@@ -0,0 +1,92 @@
+#ifndef BUFFERCACHE_H
+#define BUFFERCACHE_H
+
+#include "softwaredisk.h"
+
+// block cache between the filesystem and the software disk. Blocks are kept
+// in memory up to a fixed budget and written back when they are evicted or
+// the cache is flushed.
+
+// replacement policy
+typedef enum
+{
+    BC_LRU,  // evict the least recently used block
+    BC_CLOCK // second chance: evict the first block not referenced since the hand last passed
+} BCPolicy;
+
+// counters for sizing the cache
+typedef struct BCStats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks; // blocks written back to the software disk
+    unsigned long prefetches; // blocks read into the cache ahead of use
+} BCStats;
+
+// one cached block
+typedef struct BCEntry
+{
+    long blocknum;  // -1 when the entry holds no block
+    int dirty;      // modified since it was read or last written back
+    int referenced; // CLOCK reference bit
+    int pins;       // pin_cache_blocks() calls not undone yet, a pinned block is never evicted
+    int prev;       // LRU list, towards the most recently used entry
+    int next;       // LRU list, towards the least recently used entry
+    int hash_next;  // next entry in the same hash bucket
+} BCEntry;
+
+typedef struct BufferCache
+{
+    SoftwareDisk disk; // the software disk the blocks are cached from
+    int block_size;
+    int capacity; // number of blocks that fit in the budget
+    int num_used;
+    BCPolicy policy;
+    BCEntry *entries;
+    char *data; // block of entries[i] at data + i * block_size
+    int *buckets;
+    int num_buckets;
+    int lru_head; // most recently used entry
+    int lru_tail; // least recently used entry
+    int clock_hand;
+    int num_pinned; // pins of all entries, at most half the capacity
+    BCStats stats;
+} BufferCache;
+
+//////// CACHE OPERATIONS ////////////
+
+// init an empty cache of at most 'budget' bytes of 'block_size' blocks of disk, return 1 for success, 0 for error
+int init_cache(BufferCache *cache, SoftwareDisk disk, unsigned long budget, BCPolicy policy, int block_size);
+
+// release the memory of the cache, dirty blocks are discarded
+void free_cache(BufferCache *cache);
+
+// read block 'blocknum' into buf, return 1 for success, 0 for error
+int read_cache_block(BufferCache *cache, void *buf, unsigned long blocknum);
+
+// write buf to block 'blocknum', the block reaches the disk on eviction or flush, return 1 for success, 0 for error
+int write_cache_block(BufferCache *cache, void *buf, unsigned long blocknum);
+
+// read 'count' blocks, missing blocks are fetched with one vectored read, return 1 for success, 0 for error
+int read_cache_blocks(BufferCache *cache, SDBlockIO *ios, unsigned long count);
+
+// read the blocks 'blocknums[0..count-1]' that are not cached yet into the cache with one vectored
+// read, so that later reads of them are hits, return 1 for success, 0 for error
+int prefetch_cache_blocks(BufferCache *cache, unsigned long *blocknums, unsigned long count);
+
+// pin the blocks 'blocknums[0..count-1]', fetching the missing ones with one vectored read, and set
+// data[i] to the cached data of blocknums[i]. A pinned block stays cached at the same address until
+// unpin_cache_block(). Fails when it would pin more than half the capacity, return 1 for success, 0 for error
+int pin_cache_blocks(BufferCache *cache, unsigned long *blocknums, unsigned long count, char **data);
+
+// undo one pin_cache_blocks() of block 'blocknum'
+void unpin_cache_block(BufferCache *cache, unsigned long blocknum);
+
+// write 'count' blocks into the cache, return 1 for success, 0 for error
+int write_cache_blocks(BufferCache *cache, SDBlockIO *ios, unsigned long count);
+
+// write every dirty block back to disk in block order with one vectored write, return 1 for success, 0 for error
+int flush_cache(BufferCache *cache);
+
+#endif
@@ -1,81 +1,313 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <endian.h>
+#include <time.h>
 #include "softwaredisk.h"
+#include "buffercache.h"
 #include "filesystem.h"
 
 // number of entries = number of inodes = number of files
 #define NUM_FILES 800
 #define NUM_BYTES_PER_ADDRESS 4
-#define MAX_FILE_SIZE 71680
-#define MAX_BLOCKS 140
+
+// default memory budget of the block cache
+#define DEFAULT_CACHE_BUDGET (1024 * 1024)
+
+// SUPERBLOCK SPECS
+// block 0 identifies the binary format, the layout follows from the geometry
+#define SUPERBLOCK 0
+#define FS_MAGIC "LSUFSBIN"
+#define FS_VERSION 1
 
 // DIR SPECS
+// structure of 1 entry, integers little endian
+// |--name(62bytes)--|--file_no(2bytes)--|
+// TOTAL 64 bytes
 #define ENTRY_SIZE 64
-#define NUM_BYTES_PER_FILENO 3
+#define NAME_SIZE 62
+#define MAX_NAME_LENGTH 60
+
+// buckets of the in memory name index, a power of 2 above NUM_FILES
+#define NUM_NAME_BUCKETS 1024
+
+// file handles are allocated this many at a time and then reused
+#define HANDLE_CHUNK 64
+
+// dirty metadata older than this is written back with the block cache on the next update
+#define METADATA_WRITEBACK_USECS 5000000
+
+// read-ahead window of a sequential reader in blocks, doubled from MIN up to MAX while
+// the reads stay sequential, and never more than a quarter of the block cache
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 64
+
+// blocks moved by one vectored transfer of read_at() and write_through(), which
+// bounds their stack use however large the read or write
+#define TRANSFER_BLOCKS 256
 
 // INODE SPECS
-// structure of 1 inode
-// |--size(7byte)--|--blocks(5bytes)--|--12_direct_blocks(12*4)--|--1_single_indirect(1*4)--|
-// TOTAL 64 bytes
-#define INODE_SIZE 64
-#define NUM_BYTES_FOR_SIZE 7
-#define NUM_BYTES_FOR_BLOCKS 5
+// structure of 1 inode, integers little endian
+// |--size(8bytes)--|--blocks(4bytes)--|--flags(4bytes)--|--12_direct_blocks(12*4)--|
+// |--single_indirect(4)--|--double_indirect(4)--|--triple_indirect(4)--|--reserved(52bytes)--|
+// TOTAL 128 bytes. Block number 0 (the superblock) means no block.
+// The single indirect block holds block numbers, the double indirect block numbers of
+// such blocks and the triple indirect block numbers of double indirect like blocks.
+// An inode with INODE_EXTENTS set maps its blocks with extents instead:
+// |--size(8bytes)--|--blocks(4bytes)--|--flags(4bytes)--|--num_extents(4bytes)--|
+// |--extent_block(4bytes)--|--13_extents(13*8)--|
+// an extent being |--start(4bytes)--|--length(4bytes)--|, the blocks start to start + length - 1.
+// The extents past the 13th are kept in a chain of extent blocks from extent_block.
+#define INODE_SIZE 128
 #define NUM_DIRECT_BLOCK 12
-#define NUM_SINGLE_INDIRECT 1
+#define SINGLE_INDIRECT 12
+#define DOUBLE_INDIRECT 13
+#define TRIPLE_INDIRECT 14
+#define NUM_BLOCK_POINTERS 15
+#define NUM_INODE_EXTENTS 13
+#define INODE_USED 1
+#define INODE_EXTENTS 2
+
+// EXTENT BLOCK SPECS
+// |--next_extent_block(4bytes)--|--num_extents(4bytes)--|--extents(8bytes each)--|
+#define EXTENT_BLOCK_HEADER 8
+#define EXTENT_SIZE 8
+
+// LEGACY ASCII FORMAT SPECS, only read when migrating an old disk
+// entry: |--name(61bytes)--|--file_no(3bytes)--|
+// inode: |--size(7bytes)--|--blocks(5bytes)--|--12_direct_blocks(12*4)--|--1_single_indirect(1*4)--|
+#define ASCII_ENTRY_SIZE 64
+#define ASCII_BYTES_PER_FILENO 3
+#define ASCII_INODE_SIZE 64
+#define ASCII_BYTES_FOR_SIZE 7
+#define ASCII_BYTES_FOR_BLOCKS 5
 
 // DEFINITION OF STRUCTS
 
+// one mounted filesystem, defined below
+typedef struct FileSystemInternals FileSystemInternals;
+
+// geometry of the software disk and the file size limits derived from it
+typedef struct DiskSpecs
+{
+    int block_size;
+    int num_blocks;
+    unsigned long max_blocks;    // max number of blocks per file: what the inode can address, at most the disk
+    unsigned long max_file_size; // max_blocks * block_size
+} DiskSpecs;
+
+// on disk superblock, integers little endian
+typedef struct SuperBlock
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t num_blocks;
+    uint32_t num_files;
+    uint32_t dir_start;
+    uint32_t inodes_start;
+    uint32_t bitmap_start;
+    uint32_t data_start;
+} SuperBlock;
+
+// on disk directory entry, unused when name[0] is '\0'. The on disk structs are
+// laid out without padding, so they are copied to and from blocks as they are.
+typedef struct DirEntry
+{
+    char name[NAME_SIZE];
+    uint16_t file_no;
+} DirEntry;
+
+// on disk extent
+typedef struct Extent
+{
+    uint32_t start;
+    uint32_t length;
+} Extent;
+
+// on disk inode, unused unless flags has INODE_USED
+typedef struct Inode
+{
+    uint64_t size;
+    uint32_t blocks;
+    uint32_t flags;
+    union
+    {
+        struct
+        {
+            uint32_t block_nums[NUM_BLOCK_POINTERS]; // 12 direct, single, double and triple indirect
+            uint8_t reserved[INODE_SIZE - 16 - NUM_BLOCK_POINTERS * 4];
+        };
+        struct // with INODE_EXTENTS
+        {
+            uint32_t num_extents;
+            uint32_t extent_block; // first block of the extent chain, 0 for none
+            Extent extents[NUM_INODE_EXTENTS];
+        };
+    };
+} Inode;
+
+_Static_assert(sizeof(DirEntry) == ENTRY_SIZE, "DirEntry must match ENTRY_SIZE");
+_Static_assert(sizeof(Extent) == EXTENT_SIZE, "Extent must match EXTENT_SIZE");
+_Static_assert(sizeof(Inode) == INODE_SIZE, "Inode must match INODE_SIZE");
+
+// block numbers of an open file past the direct blocks, decoded once instead of
+// reading the indirect block for every lookup, see load_block_map(). Past the single
+// indirect block the pointer block of the last lookup is kept, see load_leaf()
+typedef struct BlockMap
+{
+    int *indirect;    // entries of the single indirect block, NULL until first needed
+    int num_indirect; // entries of indirect loaded, 0 until load_block_map()
+    int dirty;        // indirect changed since it was written to the indirect block
+    int *leaf;        // entries of a pointer block of the double or triple indirect tree, NULL until first needed
+    int leaf_block;   // block number of that pointer block, 0 when leaf holds none
+    int leaf_first;   // block index of the file that leaf[0] maps
+    int leaf_dirty;   // leaf changed since it was written to leaf_block
+    int end;          // no block of the file is at this block index or past it, -1 until map_block_end()
+} BlockMap;
+
+// one extent of an extent mapped file, see ExtentMap
+typedef struct FileExtent
+{
+    int first;  // block index of the file mapped to start
+    int start;  // 1st block of the extent
+    int length; // blocks of the extent
+} FileExtent;
+
+// extents of an open extent mapped file, decoded once instead of reading the extent
+// blocks for every lookup, see load_extent_map()
+typedef struct ExtentMap
+{
+    FileExtent *extents; // NULL until first needed
+    int num_extents;
+    int allocated;       // entries of extents
+    int num_blocks;      // blocks of the file the extents map
+    int loaded;          // extents holds the extents of the file
+    int *chain;          // block numbers of the extent blocks, in chain order
+    int chain_len;
+    int chain_allocated;
+    int dirty_from;      // 1st extent block changed since written, chain_len when none
+    int hint;            // extent of the last lookup, where the next one starts
+} ExtentMap;
+
+// write-behind buffer of a READ_WRITE file, see set_write_buffer()
+typedef struct WriteBuffer
+{
+    char *data;              // kept with the handle in the pool, memory included
+    unsigned long allocated; // bytes of data
+    unsigned long size;      // bytes used for this open, 0 when writes go straight to the blocks
+    unsigned long start;     // file position of data[0]
+    unsigned long len;       // bytes buffered
+    unsigned long limit;     // file position that flushes the buffer, on a block boundary
+} WriteBuffer;
+
+// sequential read detection and read-ahead window of a file, see read_ahead()
+typedef struct ReadAhead
+{
+    unsigned long next_pos; // position where the last read ended, a read starting there is sequential
+    int window;             // blocks prefetched at a time, 0 until a stream is detected
+    int start;              // blocks start to end - 1 of the file were prefetched
+    int end;
+    int next_hit; // first prefetched block not counted as a hit yet
+} ReadAhead;
+
+// cached blocks a file has borrowed, see borrow_at()
+typedef struct Borrowed
+{
+    unsigned long *blocks; // block numbers, each pinned once in the block cache
+    int count;
+    int allocated;
+} Borrowed;
+
 // main private file type: you implement this in filesystem.c
 typedef struct FileInternals
 {
+    FileSystemInternals *fs; // filesystem the file was opened on
     unsigned long file_no;
     unsigned long cur_pos;
     FileMode mode;
+    int is_open;                     // cleared by close_file, the handle goes back to the pool
+    struct FileInternals *next_free; // next handle in the pool
+    BlockMap map;                    // kept with the handle in the pool, memory included
+    ExtentMap extent_map;            // in place of map for an extent mapped file, kept the same way
+    WriteBuffer wbuf;
+    ReadAhead ra;
+    Borrowed borrowed;
 } FileInternals;
 
+// block of handles owned by the handle pool of a filesystem
+typedef struct HandleChunk
+{
+    struct HandleChunk *next;
+    FileInternals handles[HANDLE_CHUNK];
+} HandleChunk;
+
 typedef struct DirStruct
 {
     int start_block;
     int num_entries_per_block;
     int num_blocks_for_Dir;
     int size;
-    char entries[NUM_FILES][ENTRY_SIZE];
-    int opened_files[NUM_FILES];
+    DirEntry entries[NUM_FILES];
+    int readers[NUM_FILES]; // open READ_ONLY handles of each file
+    int writers[NUM_FILES]; // open READ_WRITE handles of each file, at most 1
+    int buckets[NUM_NAME_BUCKETS]; // name index: first entry of each bucket, -1 when empty
+    int hash_next[NUM_FILES];      // next entry in the same bucket
+    unsigned long lookups;         // calls to get_entry
+    unsigned long probes;          // entries compared by get_entry
+    char dirty[NUM_FILES];         // per dir block, set when entries changed since written to disk
 } DirStruct;
 
 //////// DIR OPERATIONS ////////////
 
 // load the corresponding blocks from disk into the DIR structure
-int load_dir_from_disk();
+int load_dir_from_disk(FileSystemInternals *fs);
+
+// mark the block of the entry at index dirty, return 1 for success, 0 for error
+int mark_entry_dirty(FileSystemInternals *fs, int index);
 
-// write an entry at specified index to disk
-int write_entry_to_disk(int index);
+// write the dirty dir blocks to disk, return 1 for success, 0 for error
+int write_dir_to_disk(FileSystemInternals *fs);
 
 // get entry with the given filename, return the index of entry(inode), return -1 when not found
-int get_entry(char *filename);
+int get_entry(FileSystemInternals *fs, char *filename);
+
+// return the name index bucket of filename
+int name_bucket(char *filename);
+
+// add the entry at index to the name index
+void index_entry(FileSystemInternals *fs, int index);
 
-// add file_no to list of opened files, return 1 on success, 0 on error
-int add_to_opened_files(int file_no);
+// remove the entry at index from the name index
+void unindex_entry(FileSystemInternals *fs, int index);
 
-// delete file_no from the list of opened files, return 1 on success, 0 on error
-int delete_from_opened_files(int file_no);
+// rebuild the name index from the entries
+void build_name_index(FileSystemInternals *fs);
+
+// count an open of file_no in mode, return 1 on success, 0 when file_no is open for writing,
+// or open at all for a READ_WRITE open
+int add_to_opened_files(FileSystemInternals *fs, int file_no, FileMode mode);
+
+// count a close of file_no opened in mode, return 1 on success, 0 on error
+int delete_from_opened_files(FileSystemInternals *fs, int file_no, FileMode mode);
 
 // check a file with given file_no is opened, return 1 on true, 0 on false
-int is_opened(int file_no);
+int is_opened(FileSystemInternals *fs, int file_no);
 
 // return the number of used entry
-int num_used_entries();
+int num_used_entries(FileSystemInternals *fs);
 
 // delete an entry at index, remove file from openned file list, also delete corresponding inode, then write changes to disk
-int delete_entry(int index);
+int delete_entry(FileSystemInternals *fs, int index);
 
 // add an new entry with given filename, return the index of new entry, return -1  max file number exceeded or illegal filename, then write changes to disk
-int add_entry(char *filename);
+int add_entry(FileSystemInternals *fs, char *filename);
 
 // print entry at index
-void print_entry(int index);
+void print_entry(FileSystemInternals *fs, int index);
 
 typedef struct InodesStruct
 {
@@ -83,306 +315,629 @@ typedef struct InodesStruct
     int num_inodes_per_block;
     int num_blocks_for_inodes;
     int size;
-    char list_inodes[NUM_FILES][INODE_SIZE];
+    Inode list_inodes[NUM_FILES];
+    char dirty[NUM_FILES]; // per inode block, set when inodes changed since written to disk
 } InodesStruct;
 
 //////// INODES OPERATIONS ////////////
 
 // load the corresponding blocks from disk into the inodes structure
-int load_inodes_from_disk();
+int load_inodes_from_disk(FileSystemInternals *fs);
 
-// write an inode at specified index to disk
-int write_inode_to_disk(int index);
+// mark the block of the inode at index dirty, return 1 for success, 0 for error
+int mark_inode_dirty(FileSystemInternals *fs, int index);
+
+// write the dirty inode blocks to disk, return 1 for success, 0 for error
+int write_inodes_to_disk(FileSystemInternals *fs);
 
 // load the content of the inode at index into buf
-int read_inode(char *buf, int index);
+int read_inode(FileSystemInternals *fs, Inode *buf, int index);
 
 // write data to inode at index, return 1 for success, 0 for error
-int write_inode(char *data, int index);
+int write_inode(FileSystemInternals *fs, Inode *data, int index);
 
 // return the number of used inodes
-int num_used_inodes();
+int num_used_inodes(FileSystemInternals *fs);
 
 // delete an inode at index, return 1 for success, 0 for error, then write changes to disk
-int delete_inode(int index);
+int delete_inode(FileSystemInternals *fs, int index);
 
 // add an empty inode at index, return 1 for success, 0 for error, then write changes to disk
-int add_inode(int index);
+int add_inode(FileSystemInternals *fs, int index);
 
 // print inode at index
-void print_inode(int index);
+void print_inode(FileSystemInternals *fs, int index);
 
 // return the size of file with given inode
-int get_size_in_inode(char *inode_data);
+unsigned long get_size_in_inode(Inode *inode);
 
 // set the size of file to given inode, return 1 for success, 0 for error
-int set_size_in_inode(char *inode_data, int size);
+int set_size_in_inode(FileSystemInternals *fs, Inode *inode, unsigned long size);
 
 // return the number of blocks with given inode
-int get_blocks_in_inode(char *inode_data);
+int get_blocks_in_inode(Inode *inode);
 
 // set the number of blocks to given inode, return 1 for success, 0 for error
-int set_blocks_in_inode(char *inode_data, int blocks);
+int set_blocks_in_inode(FileSystemInternals *fs, Inode *inode, int blocks);
 
-// return the block number with given inode and direct block(0-11), return -1 for error. Can be used to get the block num for single indirect(index = 12)
-int get_direct_block_num(char *inode_data, int index);
+// return the block number with given inode and direct block(0-11), return -1 for error. Can be used to get the block num for the single, double and triple indirect(index = 12-14)
+int get_direct_block_num(Inode *inode, int index);
 
 // set the block number at specified direct block(0-11) with given inode, return 1 for success, 0 for error
-// can be used to set block number for single indirect(index = 12)
-int set_direct_block_num(char *inode_data, int direct_block, int num);
+// can be used to set block number for the single, double and triple indirect(index = 12-14)
+int set_direct_block_num(FileSystemInternals *fs, Inode *inode, int direct_block, int num);
+
+// return the number of pointer blocks between the inode and block index of a file, 0 for a direct block, and
+// set slot to the block pointer of the inode it starts from and offsets[level] to the entry used in the pointer
+// block at each level. Return -1 when index is past what an inode can address
+int block_path(FileSystemInternals *fs, int index, int *slot, int *offsets);
+
+// return the block number of the pointer block at level(0 for the one the inode points to) on the path to
+// a block, see block_path(), of the file with given inode, return 0 when there is none
+int path_block_num(FileSystemInternals *fs, Inode *inode, int slot, int *offsets, int level);
+
+// return 1 when the file with given inode maps its blocks with extents, 0 when with block numbers
+int is_extent_inode(Inode *inode);
+
+// return the number of pointer blocks a file with given inode gets when it grows to block index, the
+// pointer blocks that start at index
+int new_pointer_blocks(FileSystemInternals *fs, Inode *inode, int index);
+
+// return the block number with given inode and block index, walking the indirect blocks, return -1 for error
+int get_block_num(FileSystemInternals *fs, Inode *inode, int index);
 
-// return the block number with given block and index(0-139), return -1 for error
-int get_block_num(char *inode_data, int index);
+// set the block number at given block index with given num, return 1 for success, 0 for error.
+// The pointer blocks on the way must exist
+int set_block_num(FileSystemInternals *fs, Inode *inode, int index, int num);
 
-// set the block number at specified index(0-139) with given num, return 1 for success, 0 for error
-int set_block_num(char *inodes_data, int index, int num);
+// give back the blocks of the file with given inode with discard_blocks(), pointer blocks included,
+// return 1 for success, 0 when some of them stay allocated
+int free_file_blocks(FileSystemInternals *fs, Inode *inode);
 
+// free data blocks. On disk block data_start + k is free when bit 0x80 >> (k % 8) of
+// byte k / 8 is set, in memory when bit k % 64 of words[k / 64] is set
 typedef struct BitMap
 {
     int start_block;
+    int data_start; // first data block, tracked by bit 0
     int max_block;
-    int size;
+    int size; // bytes of the map on disk
     int blocks_for_map;
-    char *map;
+    int num_bits;    // data blocks, the bits past them are never set
+    int num_words;
+    uint64_t *words;
+    int cursor;      // word the next allocation starts searching from
+    int free_blocks; // set bits
+    char *dirty;     // per map block, set when it changed since written to disk
 } BitMap;
 
+// blocks reserved by get_free_blocks() for an allocation and not taken yet, see take_block()
+typedef struct BlockRun
+{
+    int next;   // next block of the run
+    int left;   // blocks of the run not taken yet
+    int wanted; // blocks the allocation still needs, the size asked for the next run
+} BlockRun;
+
+// position in the segments of a scatter/gather transfer
+typedef struct SegmentCursor
+{
+    FileIOVec *iov;
+    int iovcnt;
+    int seg;           // segment of the next byte
+    unsigned long off; // offset of the next byte in that segment
+} SegmentCursor;
+
+// everything a mounted filesystem owns, see fs_mount()
+struct FileSystemInternals
+{
+    SoftwareDisk sd;
+    DiskSpecs disk;
+    DirStruct dir;
+    InodesStruct inodes;
+    BitMap bitmap;
+    BufferCache cache;
+    unsigned long cache_budget;
+    CachePolicy cache_policy;
+    BlockMapping block_mapping; // of the files created, see set_block_mapping()
+    ScrubPolicy scrub_policy;   // of the blocks files give back, see set_scrub_policy()
+    HandleChunk *handle_chunks;  // memory of the handle pool
+    FileInternals *free_handles; // handles ready for reuse
+    int metadata_dirty;              // inodes, dir or bitmap changed since the last write back
+    struct timespec metadata_since;  // when metadata_dirty was set
+    unsigned long readahead_blocks;  // blocks prefetched by read_ahead()
+    unsigned long readahead_hits;    // prefetched blocks read by read_file
+    char *zero_block;                // block of zeros lent for holes by borrow_at() and written by discard_blocks(),
+                                     // NULL until first needed
+};
+
+//////// HANDLE OPERATIONS ////////////
+
+// take a file handle from the pool, growing it by HANDLE_CHUNK handles when empty, return NULL on error
+FileInternals *alloc_handle(FileSystemInternals *fs);
+
+// mark file closed and put it back in the pool
+void release_handle(FileSystemInternals *fs, FileInternals *file);
+
+// free the memory of the pool, every handle becomes invalid
+void free_handles(FileSystemInternals *fs);
+
+//////// BLOCK MAP OPERATIONS ////////////
+
+// decode the indirect block of file with given inode into file->map, return 1 for success, 0 for error
+int load_block_map(FileSystemInternals *fs, FileInternals *file, Inode *inode);
+
+// start an empty map for the indirect block just given to inode, return 1 for success, 0 for error
+int new_block_map(FileSystemInternals *fs, FileInternals *file);
+
+// make file->map.leaf the pointer block mapping block index, past the single indirect block, of file
+// with given inode, return 1 for success, 0 when there is no such pointer block, -1 for error
+int load_leaf(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index);
+
+// write a changed leaf of file back to its pointer block, return 1 for success, 0 for error
+int write_leaf(FileSystemInternals *fs, FileInternals *file);
+
+// return the block number at index of file, with given inode, return 0 for a hole, -1 for error
+int map_block_num(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index);
+
+// set the block number at index of file, with given inode, to num, return 1 for success, 0 for error.
+// Past the direct blocks only the map changes until write_block_map()
+int map_set_block_num(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index, int num);
+
+// give file, with given inode, a block for the hole at block index and the pointer blocks missing on the way
+// to it, all taken from run. Return the new block number, -1 when the disk is full, -2 when the pointer
+// blocks on the way can't be read or written
+int map_alloc_block(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index, BlockRun *run);
+
+// write a changed map of file back to its indirect or extent blocks, return 1 for success, 0 for error
+int write_block_map(FileSystemInternals *fs, FileInternals *file);
+
+// return a block index no block of file, with given inode, is at or past: the one past its last block
+// when first found, kept up by the allocations and truncations of file since. Return -1 for error
+int map_block_end(FileSystemInternals *fs, FileInternals *file, Inode *inode);
+
+// return the largest block index mapped below pointer block block_num, depth levels above the data
+// blocks, which maps the blocks from index first on. Return -1 when there is none, -2 for error
+long last_tree_block(FileSystemInternals *fs, int block_num, int depth, long first);
+
+// free the blocks of file, with given inode, from block index keep on, and the pointer blocks left
+// without blocks, a run of consecutive blocks at a time. Return the number of data blocks freed, -1 for error
+int map_truncate(FileSystemInternals *fs, FileInternals *file, Inode *inode, int keep);
+
+// free the blocks from index keep on below pointer block block_num, depth levels above the data blocks,
+// which maps the blocks from index first on, adding them to freed and the data blocks to count. Return 1
+// when block_num is left without blocks, for the caller to free once nothing points to it, 0 when it
+// stays, -1 for error
+int truncate_pointer_tree(FileSystemInternals *fs, int block_num, int depth, long first, int keep, BlockRun *freed,
+                          int *count);
+
+//////// EXTENT MAP OPERATIONS ////////////
+
+// decode the extents of the file with given inode, from the inode and its extent blocks, into map,
+// return 1 for success, 0 for error
+int load_extent_map(FileSystemInternals *fs, ExtentMap *map, Inode *inode);
+
+// make room in map for count extents and count extent blocks, return 1 for success, 0 for error
+int reserve_extent_map(ExtentMap *map, int count);
+
+// return the block number at index of the file with given inode and extents in map, return 0 for a hole,
+// -1 for error
+int extent_block_num(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int index);
+
+// add extent to the count extents of list, merging it into the last one when they are both holes or
+// their blocks follow each other
+void merge_extent(FileExtent *list, int *count, FileExtent extent);
+
+// replace extents lo to hi - 1 of map, of the file with given inode, with the count extents of repl,
+// taking or freeing extent blocks for the new number of extents, and update the inode. Return 1 for
+// success, 0 when the disk is full, leaving map as it was
+int splice_extents(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int lo, int hi, FileExtent *repl, int count);
+
+// give the file with given inode and extents in map a block for the hole at block index, taken from run,
+// growing the extent before or after it when the block follows or precedes it. Return the new block
+// number, -1 when the disk is full
+int extent_alloc_block(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int index, BlockRun *run);
+
+// write the changed extent blocks of map back, return 1 for success, 0 for error
+int write_extent_map(FileSystemInternals *fs, ExtentMap *map);
+
+// free the blocks of the file with given inode and extents in map from block index keep on, an extent
+// at a time, return the number of blocks freed, -1 for error
+int extent_truncate(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int keep);
+
+// give back the blocks of the extent mapped file with given inode with discard_blocks(), extent blocks
+// included, return 1 for success, 0 when some of them stay allocated
+int free_extent_blocks(FileSystemInternals *fs, Inode *inode);
+
+//////// FILE DATA OPERATIONS ////////////
+
+// return the total length of the iovcnt segments of iov
+unsigned long segments_length(FileIOVec *iov, int iovcnt);
+
+// return the next len bytes at cur when they lie in a single segment, otherwise NULL
+char *segment_span(SegmentCursor *cur, unsigned long len);
+
+// move cur len bytes on, copying them into the segments from data when to_segments is set,
+// from the segments into data otherwise. A NULL data only moves cur
+void segment_copy(SegmentCursor *cur, char *data, unsigned long len, int to_segments);
+
+// lay out a transfer of numbytes between the segments at cur and count blocks, from byte first of the
+// 1st block: lens[i] gets the bytes of block i in it, and ios[i].buf points straight into the segments
+// when block i is moved whole from or to one segment, otherwise at a block of the returned staging
+// buffer, with staged[i] set. The staging buffer is local, which holds 2 blocks, when that is enough,
+// otherwise allocated. Return NULL for error
+char *stage_blocks(FileSystemInternals *fs, SegmentCursor *cur, unsigned long first, unsigned long numbytes,
+                   int count, SDBlockIO *ios, int *lens, char *staged, char *local);
+
+// copy the staged blocks of a transfer laid out by stage_blocks() into the segments when to_segments is
+// set, from the segments otherwise, moving cur past the transfer
+void copy_staged(SegmentCursor *cur, unsigned long first, int count, SDBlockIO *ios, int *lens, char *staged,
+                 int to_segments);
+
+// read at most the length of the iovcnt segments of iov from file, from byte pos, into the segments,
+// return the number of bytes read
+unsigned long read_at(FileSystemInternals *fs, FileInternals *file, FileIOVec *iov, int iovcnt, unsigned long pos);
+
+// write zeros over the blocks of file, with given inode, from block index first to last, holes left as
+// they are, return 1 for success, 0 for error
+int zero_blocks(FileSystemInternals *fs, FileInternals *file, Inode *inode, int first, int last);
+
+// set the length of file to len bytes, freeing its blocks past it, return 1 for success, 0 for error
+int truncate_at(FileSystemInternals *fs, FileInternals *file, unsigned long len);
+
+// give the holes of file up to byte len blocks, the length left as it is, return 1 for success, 0 for error
+int preallocate_at(FileSystemInternals *fs, FileInternals *file, unsigned long len);
+
+//////// WRITE BUFFER OPERATIONS ////////////
+
+// write the iovcnt segments of iov at byte pos of file straight to its blocks, return the number of bytes written
+unsigned long write_through(FileSystemInternals *fs, FileInternals *file, FileIOVec *iov, int iovcnt, unsigned long pos);
+
+// gather numbytes of buf, fewer than wbuf.size, in the write buffer of file, flushing it when it fills up
+// to its limit. Return the number of bytes written, which is less than numbytes when a flush fails
+unsigned long buffer_write(FileSystemInternals *fs, FileInternals *file, void *buf, unsigned long numbytes);
+
+// write the buffered bytes of file to its blocks, return 1 for success, 0 for error
+int flush_write_buffer(FileSystemInternals *fs, FileInternals *file);
+
+//////// READ AHEAD OPERATIONS ////////////
+
+// called by read_at() and borrow_at() reading blocks start_block to end_block of file, with given inode, from pos.
+// Count the read-ahead hits, then when the read continues the last one, prefetch the next window
+// of blocks into the block cache, growing the window; otherwise stop reading ahead
+void read_ahead(FileSystemInternals *fs, FileInternals *file, Inode *inode, int start_block, int end_block, unsigned long pos);
+
+//////// BORROW OPERATIONS ////////////
+
+// pin the blocks holding at most numbytes of file from byte pos, at most maxspans of them and no more than
+// the block cache allows, and point spans at their data, setting *numspans. Return the number of bytes borrowed
+unsigned long borrow_at(FileSystemInternals *fs, FileInternals *file, unsigned long numbytes, FileSpan *spans,
+                        int maxspans, int *numspans, unsigned long pos);
+
+// unpin every block file has borrowed
+void release_borrowed(FileSystemInternals *fs, FileInternals *file);
+
+//////// WRITE BACK OPERATIONS ////////////
+
+// note a metadata change, starting the write back timer when nothing was dirty
+void start_metadata_timer(FileSystemInternals *fs);
+
+// write the dirty inode, dir and bitmap blocks into the block cache, return 1 for success, 0 for error
+int write_metadata(FileSystemInternals *fs);
+
+// write the changed maps of every open file, the metadata, then the block cache back, return 1 for success, 0 for error
+int write_back_fs(FileSystemInternals *fs);
+
+// write_back_fs() when the metadata has been dirty for METADATA_WRITEBACK_USECS
+void write_back_if_due(FileSystemInternals *fs);
+
 //////// BITMAP OPERATIONS ////////////
 
 // init bitmap
-int init_bitmap();
+int init_bitmap(FileSystemInternals *fs);
+
+// write the dirty blocks of the bitmap to disk
+int write_bitmap_to_disk(FileSystemInternals *fs);
 
-// write bitmap to disk
-int write_bitmap_to_disk();
+// mark the map blocks holding bits first to last dirty
+void mark_bitmap_dirty(FileSystemInternals *fs, int first, int last);
 
 // load the corresponding block from disk to the bitmap structure
-int load_bitmap_from_disk();
+int load_bitmap_from_disk(FileSystemInternals *fs);
 
 // free the disk block at index
-int free_block(int index);
+int free_block(FileSystemInternals *fs, int index);
 
 // set the disk block at index
-int set_block(int index);
+int set_block(FileSystemInternals *fs, int index);
 
 // return index of a free block, return -1 when disk is full
-int get_free_block();
+int get_free_block(FileSystemInternals *fs);
+
+// allocate up to count free blocks in a row: the first run of count free blocks from the cursor on,
+// otherwise the longest run there is. Return the first block and set got to the number allocated,
+// return -1 when disk is full
+int get_free_blocks(FileSystemInternals *fs, int count, int *got);
+
+// free the count disk blocks from first on
+void free_block_run(FileSystemInternals *fs, int first, int count);
+
+// take the next block of run, allocating a run of run->wanted blocks when it is used up,
+// return -1 when disk is full
+int take_block(FileSystemInternals *fs, BlockRun *run);
+
+// free the blocks of run that were not taken
+void release_run(FileSystemInternals *fs, BlockRun *run);
+
+// add disk block index, given back by a file, to the blocks of run, giving them back with discard_blocks()
+// first when index doesn't follow them. A block number 0, a hole, is skipped. Return the result of
+// discard_blocks(), 1 when there was nothing to give back
+int add_to_free_run(FileSystemInternals *fs, BlockRun *run, int index);
+
+// free the count blocks from first on, given back by a file, writing zeros over them first with
+// SCRUB_SYNC, see set_scrub_policy(). Blocks that can't be zeroed stay allocated, return 1 for
+// success, 0 for error
+int discard_blocks(FileSystemInternals *fs, int first, int count);
+
+// mark every data block free
+void free_all_blocks(FileSystemInternals *fs);
+
+//////// FORMAT OPERATIONS ////////////
+
+// return the number in the ASCII decimal field of width bytes
+int parse_ascii_number(char *field, int width);
+
+// write the superblock describing the binary format and the layout
+int write_superblock(FileSystemInternals *fs);
+
+// convert a disk in the old ASCII format into the binary format, relocating the data blocks
+// the larger binary metadata now covers, return 1 for success, 0 for error
+int migrate_ascii_format(FileSystemInternals *fs);
+
+// check the superblock matches the layout, migrate a disk without one, return 1 for success, 0 for error
+int init_format(FileSystemInternals *fs);
 
 // GLOBALS
-// intance of directory
-// instance of inodes
-// instance of bitmap
+// instance of the filesystem behind the API without a handle, mounted on the
+// default software disk on first use
 
-static InodesStruct inodes;
-static DirStruct dir;
-static BitMap bitmap;
+static FileSystemInternals default_fs = {.cache_budget = DEFAULT_CACHE_BUDGET, .cache_policy = CACHE_LRU,
+                                         .block_mapping = MAPPING_BLOCKS, .scrub_policy = SCRUB_LAZY};
 int is_init = 0;
 
-FSError fserror;
+_Thread_local FSError fserror;
 
 /////////////////////////////// HELPER FUNCTIONS ///////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 // SPECS
-void print_specs()
+void print_specs(FileSystemInternals *fs)
 {
-    printf("dir start_block %d\n", dir.start_block);
-    printf("dir num_entries_per_block %d\n", dir.num_entries_per_block);
-    printf("dir num_blocks_for_Dir %d\n", dir.num_blocks_for_Dir);
-    printf("dir size %d\n", dir.size);
+    printf("disk block_size %d\n", fs->disk.block_size);
+    printf("disk num_blocks %d\n", fs->disk.num_blocks);
+    printf("disk max_blocks %lu\n", fs->disk.max_blocks);
+    printf("disk max_file_size %lu\n", fs->disk.max_file_size);
     printf("-----------------------------------------------\n");
-    printf("inodes start_block %d\n", inodes.start_block);
-    printf("inodes num_inodes_per_block %d\n", inodes.num_inodes_per_block);
-    printf("inodes num_blocks_for_inodes %d\n", inodes.num_blocks_for_inodes);
-    printf("inodes size %d\n", inodes.size);
+    printf("dir start_block %d\n", fs->dir.start_block);
+    printf("dir num_entries_per_block %d\n", fs->dir.num_entries_per_block);
+    printf("dir num_blocks_for_Dir %d\n", fs->dir.num_blocks_for_Dir);
+    printf("dir size %d\n", fs->dir.size);
     printf("-----------------------------------------------\n");
-    printf("bitmap start_block %d\n", bitmap.start_block);
-    printf("bitmap max_block %d\n", bitmap.max_block);
-    printf("bitmap size %d\n", bitmap.size);
-    printf("Number of blocks for bitmap %d\n", bitmap.blocks_for_map);
+    printf("inodes start_block %d\n", fs->inodes.start_block);
+    printf("inodes num_inodes_per_block %d\n", fs->inodes.num_inodes_per_block);
+    printf("inodes num_blocks_for_inodes %d\n", fs->inodes.num_blocks_for_inodes);
+    printf("inodes size %d\n", fs->inodes.size);
+    printf("-----------------------------------------------\n");
+    printf("bitmap start_block %d\n", fs->bitmap.start_block);
+    printf("bitmap data_start %d\n", fs->bitmap.data_start);
+    printf("bitmap max_block %d\n", fs->bitmap.max_block);
+    printf("bitmap size %d\n", fs->bitmap.size);
+    printf("Number of blocks for bitmap %d\n", fs->bitmap.blocks_for_map);
 }
 
 ////////////// DIR OPERATIONS DEFINITION //////////////
-int load_dir_from_disk()
+int load_dir_from_disk(FileSystemInternals *fs)
 {
-    char buf[SOFTWARE_DISK_BLOCK_SIZE];
+    char buf[fs->disk.block_size];
     int success = 0;
-    dir.size = 0;
-    for (int z = 0; z < dir.num_blocks_for_Dir; z++)
+    fs->dir.size = 0;
+    for (int z = 0; z < fs->dir.num_blocks_for_Dir; z++)
     {
         // read each block to buf
-        success = read_sd_block(buf, dir.start_block + z);
+        success = read_cache_block(&fs->cache, buf, fs->dir.start_block + z);
         if (success)
         {
-            for (int i = 0; i < dir.num_entries_per_block; i++)
+            for (int i = 0; i < fs->dir.num_entries_per_block && z * fs->dir.num_entries_per_block + i < NUM_FILES; i++)
             {
-                if (buf[i * ENTRY_SIZE] != '\0')
-                    dir.size++;
-                for (int j = 0; j < ENTRY_SIZE; j++)
-                {
-                    dir.entries[z * dir.num_entries_per_block + i][j] = buf[j + i * ENTRY_SIZE];
-                }
+                DirEntry *entry = &fs->dir.entries[z * fs->dir.num_entries_per_block + i];
+                memcpy(entry, buf + i * ENTRY_SIZE, ENTRY_SIZE);
+                if (entry->name[0] != '\0')
+                    fs->dir.size++;
             }
         }
         else
             break;
     }
+    build_name_index(fs);
     return success;
 }
 
-int write_entry_to_disk(int index)
+int mark_entry_dirty(FileSystemInternals *fs, int index)
 {
     int success = 0;
-    if (index < dir.size && index >= 0)
+    if (index < NUM_FILES && index >= 0)
     {
-        char buf[SOFTWARE_DISK_BLOCK_SIZE];
-        int target_block_index = (int)(index / dir.num_entries_per_block) + dir.start_block;
-        int target_segment_index = index * ENTRY_SIZE - (target_block_index - dir.start_block) * SOFTWARE_DISK_BLOCK_SIZE;
+        start_metadata_timer(fs);
+        fs->dir.dirty[index / fs->dir.num_entries_per_block] = 1;
+        success = 1;
+    }
+    return success;
+}
 
-        success = read_sd_block(buf, (unsigned long)target_block_index);
-        if (success)
+int write_dir_to_disk(FileSystemInternals *fs)
+{
+    int success = 1;
+    char buf[fs->disk.block_size];
+    for (int z = 0; success && z < fs->dir.num_blocks_for_Dir; z++)
+    {
+        if (!fs->dir.dirty[z])
+            continue;
+        // every entry of the block is in memory, no need to read it first
+        memset(buf, 0, fs->disk.block_size);
+        for (int i = 0; i < fs->dir.num_entries_per_block && z * fs->dir.num_entries_per_block + i < NUM_FILES; i++)
         {
-            for (int k = 0; k < ENTRY_SIZE; k++)
-            {
-                buf[k + target_segment_index] = dir.entries[index][k];
-            }
+            memcpy(buf + i * ENTRY_SIZE, &fs->dir.entries[z * fs->dir.num_entries_per_block + i], ENTRY_SIZE);
         }
-        else
-            return success;
-
-        success = write_sd_block(buf, (unsigned long)target_block_index);
+        success = write_cache_block(&fs->cache, buf, (unsigned long)fs->dir.start_block + z);
+        if (success)
+            fs->dir.dirty[z] = 0;
     }
     return success;
 }
 
-int get_entry(char *filename)
+int get_entry(FileSystemInternals *fs, char *filename)
 {
-    if (dir.size == 0)
-        return -1;
-    else
+    fs->dir.lookups++;
+    int i = fs->dir.buckets[name_bucket(filename)];
+    while (i != -1)
     {
-        const int number = ENTRY_SIZE - NUM_BYTES_PER_FILENO;
-        char entry_name[number];
-        for (int i = 0; i < dir.size; i++)
-        {
-            strncpy(entry_name, dir.entries[i], number);
-            if (!(strcmp(filename, entry_name)))
-            {
-                char index[NUM_BYTES_PER_FILENO + 1];
-                index[NUM_BYTES_PER_FILENO] = '\0';
-                for (int j = 0; j < NUM_BYTES_PER_FILENO; j++)
-                {
-                    index[j] = dir.entries[i][ENTRY_SIZE - NUM_BYTES_PER_FILENO + j];
-                }
-                return atoi(index);
-            }
-        }
-        return -1;
+        fs->dir.probes++;
+        if (!strncmp(filename, fs->dir.entries[i].name, NAME_SIZE))
+            return le16toh(fs->dir.entries[i].file_no);
+        i = fs->dir.hash_next[i];
+    }
+    return -1;
+}
+
+int name_bucket(char *filename)
+{
+    // FNV-1a over the part of the name an entry can hold
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < NAME_SIZE && filename[i] != '\0'; i++)
+    {
+        hash = (hash ^ (unsigned char)filename[i]) * 16777619u;
+    }
+    return (int)(hash & (NUM_NAME_BUCKETS - 1));
+}
+
+void index_entry(FileSystemInternals *fs, int index)
+{
+    int bucket = name_bucket(fs->dir.entries[index].name);
+    fs->dir.hash_next[index] = fs->dir.buckets[bucket];
+    fs->dir.buckets[bucket] = index;
+}
+
+void unindex_entry(FileSystemInternals *fs, int index)
+{
+    int *link = &fs->dir.buckets[name_bucket(fs->dir.entries[index].name)];
+    while (*link != -1 && *link != index)
+    {
+        link = &fs->dir.hash_next[*link];
+    }
+    if (*link == index)
+        *link = fs->dir.hash_next[index];
+}
+
+void build_name_index(FileSystemInternals *fs)
+{
+    for (int i = 0; i < NUM_NAME_BUCKETS; i++)
+    {
+        fs->dir.buckets[i] = -1;
+    }
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        if (fs->dir.entries[i].name[0] != '\0')
+            index_entry(fs, i);
     }
 }
 
-void print_opened_files()
+void print_opened_files(FileSystemInternals *fs)
 {
     for (int i = 0; i < NUM_FILES; i++)
     {
-        printf("%d ", dir.opened_files[i]);
+        if (is_opened(fs, i))
+            printf("%d(r%d w%d) ", i, fs->dir.readers[i], fs->dir.writers[i]);
     }
     printf("\n");
 }
 
-int add_to_opened_files(int file_no)
+int add_to_opened_files(FileSystemInternals *fs, int file_no, FileMode mode)
 {
     int success = 0;
-    if (file_no >= 0 && file_no < NUM_FILES)
+    if (file_no >= 0 && file_no < NUM_FILES && fs->dir.writers[file_no] == 0)
     {
-        for (int i = 0; i < NUM_FILES; i++)
+        if (mode == READ_ONLY)
         {
-            if (dir.opened_files[i] == -1)
-            {
-                dir.opened_files[i] = file_no;
-                success = 1;
-                break;
-            }
+            fs->dir.readers[file_no]++;
+            success = 1;
+        }
+        else if (fs->dir.readers[file_no] == 0)
+        {
+            fs->dir.writers[file_no]++;
+            success = 1;
         }
     }
     return success;
 }
 
-int delete_from_opened_files(int file_no)
+int delete_from_opened_files(FileSystemInternals *fs, int file_no, FileMode mode)
 {
     int success = 0;
     if (file_no >= 0 && file_no < NUM_FILES)
     {
-        for (int i = 0; i < NUM_FILES; i++)
+        int *count = mode == READ_ONLY ? &fs->dir.readers[file_no] : &fs->dir.writers[file_no];
+        if (*count > 0)
         {
-            if (dir.opened_files[i] == file_no)
-            {
-                dir.opened_files[i] = -1;
-                success = 1;
-                break;
-            }
+            (*count)--;
+            success = 1;
         }
     }
     return success;
 }
 
-int is_opened(int file_no)
+int is_opened(FileSystemInternals *fs, int file_no)
 {
     int flag = 0;
     if (file_no >= 0 && file_no < NUM_FILES)
-    {
-        for (int i = 0; i < NUM_FILES; i++)
-        {
-            if (dir.opened_files[i] == file_no)
-            {
-                flag = 1;
-                break;
-            }
-        }
-    }
+        flag = fs->dir.readers[file_no] > 0 || fs->dir.writers[file_no] > 0;
     return flag;
 }
 
-int num_used_entries()
+int num_used_entries(FileSystemInternals *fs)
 {
-    return dir.size;
+    return fs->dir.size;
 }
 
-int delete_entry(int index)
+int delete_entry(FileSystemInternals *fs, int index)
 {
     int success = 0;
     if (index >= 0 && index < NUM_FILES)
     {
-        for (int i = 0; i < ENTRY_SIZE; i++)
-        {
-            dir.entries[index][i] = '\0';
-        }
+        unindex_entry(fs, index);
+        memset(&fs->dir.entries[index], 0, ENTRY_SIZE);
 
-        if (is_opened(index))
-            delete_from_opened_files(index);
+        fs->dir.readers[index] = 0;
+        fs->dir.writers[index] = 0;
 
         // update size
-        dir.size--;
+        fs->dir.size--;
 
-        success = delete_inode(index);
+        success = delete_inode(fs, index);
         if (success)
-            success = write_entry_to_disk(index);
+            success = mark_entry_dirty(fs, index);
     }
     return success;
 }
 
-int add_entry(char *filename)
+int add_entry(FileSystemInternals *fs, char *filename)
 {
     int success = -1;
-    if (dir.size < NUM_FILES)
+    if (fs->dir.size < NUM_FILES)
     {
         // check for illegal file name
         if (filename[0] != '\0')
         {
-            int char_count = 0;
-            while (filename[char_count] != '\0')
-            {
-                char_count++;
-            }
-            if (char_count >= 61)
+            if (strlen(filename) > MAX_NAME_LENGTH)
             {
                 fserror = FS_ILLEGAL_FILENAME;
                 return -1;
@@ -391,26 +946,24 @@ int add_entry(char *filename)
 
             for (; index < NUM_FILES; index++)
             {
-                if (dir.entries[index][0] == '\0')
+                if (fs->dir.entries[index].name[0] == '\0')
                     break;
             }
 
-            // copy filename
-            strncpy(dir.entries[index], filename, ENTRY_SIZE - NUM_BYTES_PER_FILENO);
-
-            // copy file number
-            char *fileno = dir.entries[index];
-            fileno = fileno + (ENTRY_SIZE - NUM_BYTES_PER_FILENO);
-            sprintf(fileno, "%d", index);
+            // copy filename and file number
+            memset(&fs->dir.entries[index], 0, ENTRY_SIZE);
+            strcpy(fs->dir.entries[index].name, filename);
+            fs->dir.entries[index].file_no = htole16(index);
+            index_entry(fs, index);
 
             // create new inode associated to entry
-            add_inode(index);
+            add_inode(fs, index);
 
             // increase size
-            dir.size++;
+            fs->dir.size++;
 
             // write entry to disk
-            write_entry_to_disk(index);
+            mark_entry_dirty(fs, index);
 
             return index;
         }
@@ -423,52 +976,44 @@ int add_entry(char *filename)
     return success;
 }
 
-void print_entry(int index)
+void print_entry(FileSystemInternals *fs, int index)
 {
-    for (int i = 0; i < ENTRY_SIZE; i++)
-    {
-        printf("%c", dir.entries[index][i]);
-    }
-    printf("\n");
+    printf("%.*s %d\n", NAME_SIZE, fs->dir.entries[index].name, le16toh(fs->dir.entries[index].file_no));
 }
 
 // init dir structure
-int init_dir()
+int init_dir(FileSystemInternals *fs)
 {
-    dir.start_block = 0;
-    dir.num_entries_per_block = SOFTWARE_DISK_BLOCK_SIZE / ENTRY_SIZE; // 8
-    dir.num_blocks_for_Dir = NUM_FILES / dir.num_entries_per_block;    // 100
-
     for (int i = 0; i < NUM_FILES; i++)
     {
-        dir.opened_files[i] = -1;
+        fs->dir.readers[i] = 0;
+        fs->dir.writers[i] = 0;
+        fs->dir.dirty[i] = 0;
     }
 
-    int success = load_dir_from_disk();
+    int success = load_dir_from_disk(fs);
     return success;
 }
 
 ////////////// INODES OPERATIONS DEFINITION //////////////
 
-int load_inodes_from_disk()
+int load_inodes_from_disk(FileSystemInternals *fs)
 {
-    char buf[SOFTWARE_DISK_BLOCK_SIZE];
+    char buf[fs->disk.block_size];
     int success = 0;
-    inodes.size = 0;
-    for (int z = 0; z < inodes.num_blocks_for_inodes; z++)
+    fs->inodes.size = 0;
+    for (int z = 0; z < fs->inodes.num_blocks_for_inodes; z++)
     {
         // read each block to buf
-        success = read_sd_block(buf, inodes.start_block + z);
+        success = read_cache_block(&fs->cache, buf, fs->inodes.start_block + z);
         if (success)
         {
-            for (int i = 0; i < inodes.num_inodes_per_block; i++)
+            for (int i = 0; i < fs->inodes.num_inodes_per_block && z * fs->inodes.num_inodes_per_block + i < NUM_FILES; i++)
             {
-                if (buf[i * INODE_SIZE] != '\0')
-                    inodes.size++;
-                for (int j = 0; j < INODE_SIZE; j++)
-                {
-                    inodes.list_inodes[z * inodes.num_inodes_per_block + i][j] = buf[j + i * INODE_SIZE];
-                }
+                Inode *inode = &fs->inodes.list_inodes[z * fs->inodes.num_inodes_per_block + i];
+                memcpy(inode, buf + i * INODE_SIZE, INODE_SIZE);
+                if (le32toh(inode->flags) & INODE_USED)
+                    fs->inodes.size++;
             }
         }
         else
@@ -477,96 +1022,96 @@ int load_inodes_from_disk()
     return success;
 }
 
-int read_inode(char *buf, int index)
+int read_inode(FileSystemInternals *fs, Inode *buf, int index)
 {
     if (index < NUM_FILES && index >= 0)
     {
-        for (int k = 0; k < INODE_SIZE; k++)
-        {
-            buf[k] = inodes.list_inodes[index][k];
-        }
+        *buf = fs->inodes.list_inodes[index];
         return 1;
     }
     else
         return 0;
 }
 
-int num_used_inodes()
+int num_used_inodes(FileSystemInternals *fs)
 {
-    return inodes.size;
+    return fs->inodes.size;
 }
 
-int write_inode_to_disk(int index)
+int mark_inode_dirty(FileSystemInternals *fs, int index)
 {
     int success = 0;
     if (index < NUM_FILES && index >= 0)
     {
-        char buf[SOFTWARE_DISK_BLOCK_SIZE];
-        int target_block_index = (int)(index / inodes.num_inodes_per_block) + inodes.start_block;
-        int target_segment_index = index * INODE_SIZE - (target_block_index - inodes.start_block) * SOFTWARE_DISK_BLOCK_SIZE;
+        start_metadata_timer(fs);
+        fs->inodes.dirty[index / fs->inodes.num_inodes_per_block] = 1;
+        success = 1;
+    }
+    return success;
+}
 
-        success = read_sd_block(buf, (unsigned long)target_block_index);
-        if (success)
+int write_inodes_to_disk(FileSystemInternals *fs)
+{
+    int success = 1;
+    char buf[fs->disk.block_size];
+    for (int z = 0; success && z < fs->inodes.num_blocks_for_inodes; z++)
+    {
+        if (!fs->inodes.dirty[z])
+            continue;
+        // every inode of the block is in memory, no need to read it first
+        memset(buf, 0, fs->disk.block_size);
+        for (int i = 0; i < fs->inodes.num_inodes_per_block && z * fs->inodes.num_inodes_per_block + i < NUM_FILES; i++)
         {
-            for (int k = 0; k < INODE_SIZE; k++)
-            {
-                buf[k + target_segment_index] = inodes.list_inodes[index][k];
-            }
+            memcpy(buf + i * INODE_SIZE, &fs->inodes.list_inodes[z * fs->inodes.num_inodes_per_block + i], INODE_SIZE);
         }
-        else
-            return success;
-
-        success = write_sd_block(buf, (unsigned long)target_block_index);
+        success = write_cache_block(&fs->cache, buf, (unsigned long)fs->inodes.start_block + z);
+        if (success)
+            fs->inodes.dirty[z] = 0;
     }
     return success;
 }
 
-int write_inode(char *data, int index)
+int write_inode(FileSystemInternals *fs, Inode *data, int index)
 {
     if (index < NUM_FILES && index >= 0)
     {
-        for (int i = 0; i < INODE_SIZE; i++)
-        {
-            inodes.list_inodes[index][i] = data[i];
-        }
+        fs->inodes.list_inodes[index] = *data;
         return 1;
     }
     else
         return 0;
 }
 
-int delete_inode(int index)
+int delete_inode(FileSystemInternals *fs, int index)
 {
     int success = 0;
     if (index < NUM_FILES && index >= 0)
     {
-        for (int i = 0; i < INODE_SIZE; i++)
-        {
-            inodes.list_inodes[index][i] = '\0';
-        }
+        memset(&fs->inodes.list_inodes[index], 0, INODE_SIZE);
 
         // update size
-        inodes.size--;
+        fs->inodes.size--;
 
-        success = write_inode_to_disk(index);
+        success = mark_inode_dirty(fs, index);
     }
     return success;
 }
 
-int add_inode(int index)
+int add_inode(FileSystemInternals *fs, int index)
 {
     int success = 0;
     if (index >= 0 && index < NUM_FILES)
     {
-        if (inodes.size < NUM_FILES)
+        if (fs->inodes.size < NUM_FILES)
         {
             // check if at index is active inode or not
-            if (inodes.list_inodes[index][0] == '\0')
+            Inode *inode = &fs->inodes.list_inodes[index];
+            if (!(le32toh(inode->flags) & INODE_USED))
             {
-                set_size_in_inode(inodes.list_inodes[index], 0);
-                set_blocks_in_inode(inodes.list_inodes[index], 0);
-                inodes.size++;
-                write_inode_to_disk(index);
+                memset(inode, 0, INODE_SIZE);
+                inode->flags = htole32(fs->block_mapping == MAPPING_EXTENTS ? INODE_USED | INODE_EXTENTS : INODE_USED);
+                fs->inodes.size++;
+                mark_inode_dirty(fs, index);
                 success = 1;
             }
         }
@@ -574,761 +1119,2886 @@ int add_inode(int index)
     return success;
 }
 
-void print_inode(int index)
+void print_inode(FileSystemInternals *fs, int index)
 {
-    for (int i = 0; i < INODE_SIZE; i++)
+    Inode *inode = &fs->inodes.list_inodes[index];
+    printf("%lu | %d |", get_size_in_inode(inode), get_blocks_in_inode(inode));
+    if (is_extent_inode(inode))
     {
-        if (i == 6 || i == 10)
-            printf("%c |", inodes.list_inodes[index][i]);
-        else
-            printf("%c", inodes.list_inodes[index][i]);
+        int num_extents = (int)le32toh(inode->num_extents);
+        for (int i = 0; i < num_extents && i < NUM_INODE_EXTENTS; i++)
+        {
+            printf(" %u+%u", le32toh(inode->extents[i].start), le32toh(inode->extents[i].length));
+        }
+        printf(" | %d extents, chain %u", num_extents, le32toh(inode->extent_block));
+    }
+    else
+    {
+        for (int i = 0; i < NUM_BLOCK_POINTERS; i++)
+        {
+            printf(" %d", get_direct_block_num(inode, i));
+        }
     }
     printf("\n");
 }
 
 // init inodes structure
-int init_inodes()
+int init_inodes(FileSystemInternals *fs)
 {
-    inodes.start_block = NUM_FILES * ENTRY_SIZE / SOFTWARE_DISK_BLOCK_SIZE; // 100
-    inodes.num_inodes_per_block = SOFTWARE_DISK_BLOCK_SIZE / INODE_SIZE;    // 8
-    inodes.num_blocks_for_inodes = NUM_FILES / inodes.num_inodes_per_block; // 100
-    int success = load_inodes_from_disk();
+    memset(fs->inodes.dirty, 0, NUM_FILES);
+    int success = load_inodes_from_disk(fs);
 
     return success;
 }
 
-int get_size_in_inode(char *inode_data)
+unsigned long get_size_in_inode(Inode *inode)
 {
-    char size[NUM_BYTES_FOR_SIZE + 1];
-    size[NUM_BYTES_FOR_SIZE] = '\0';
-    for (int i = 0; i < NUM_BYTES_FOR_SIZE; i++)
-    {
-        size[i] = inode_data[i];
-    }
-    return atoi(size);
+    return (unsigned long)le64toh(inode->size);
 }
 
-int set_size_in_inode(char *inode_data, int size)
+int set_size_in_inode(FileSystemInternals *fs, Inode *inode, unsigned long size)
 {
     int success = 0;
-    if (size <= MAX_FILE_SIZE)
+    if (size <= fs->disk.max_file_size)
     {
-        char filesize[NUM_BYTES_FOR_SIZE];
-        for (int i = 0; i < NUM_BYTES_FOR_SIZE; i++)
-        {
-            filesize[i] = '\0';
-        }
-        sprintf(filesize, "%d", size);
-        for (int i = 0; i < NUM_BYTES_FOR_SIZE; i++)
-        {
-            inode_data[i] = filesize[i];
-        }
+        inode->size = htole64((uint64_t)size);
         success = 1;
     }
     return success;
 }
 
-int get_blocks_in_inode(char *inode_data)
+int get_blocks_in_inode(Inode *inode)
 {
-    char blockno[NUM_BYTES_FOR_BLOCKS + 1];
-    blockno[NUM_BYTES_FOR_BLOCKS] = '\0';
-    for (int i = 0; i < NUM_BYTES_FOR_BLOCKS; i++)
-    {
-        blockno[i] = inode_data[i + NUM_BYTES_FOR_SIZE];
-    }
-    return atoi(blockno);
+    return (int)le32toh(inode->blocks);
 }
 
-int set_blocks_in_inode(char *inode_data, int blocks)
+int set_blocks_in_inode(FileSystemInternals *fs, Inode *inode, int blocks)
 {
     int success = 0;
-    if (blocks <= MAX_BLOCKS)
+    if (blocks >= 0 && (unsigned long)blocks <= fs->disk.max_blocks)
     {
-        char blockno[NUM_BYTES_FOR_BLOCKS];
-        for (int i = 0; i < NUM_BYTES_FOR_BLOCKS; i++)
-        {
-            blockno[i] = '\0';
-        }
-        sprintf(blockno, "%d", blocks);
-        for (int i = 0; i < NUM_BYTES_FOR_BLOCKS; i++)
-        {
-            inode_data[i + NUM_BYTES_FOR_SIZE] = blockno[i];
-        }
+        inode->blocks = htole32((uint32_t)blocks);
         success = 1;
     }
     return success;
 }
 
-int get_direct_block_num(char *inode_data, int index)
+int get_direct_block_num(Inode *inode, int index)
 {
     int blocknum = -1;
-    if (index >= 0 && index <= NUM_DIRECT_BLOCK)
-    {
-        // extra space for '\0'
-        char num[NUM_BYTES_PER_ADDRESS + 1];
-        num[NUM_BYTES_PER_ADDRESS] = '\0';
-        for (int i = 0; i < NUM_BYTES_PER_ADDRESS; i++)
-        {
-            num[i] = inode_data[i + NUM_BYTES_FOR_SIZE + NUM_BYTES_FOR_BLOCKS + index * NUM_BYTES_PER_ADDRESS];
-        }
-        blocknum = atoi(num);
-    }
+    if (index >= 0 && index < NUM_BLOCK_POINTERS)
+        blocknum = (int)le32toh(inode->block_nums[index]);
     return blocknum;
 }
 
-int set_direct_block_num(char *inode_data, int direct_block, int num)
+int set_direct_block_num(FileSystemInternals *fs, Inode *inode, int direct_block, int num)
 {
     int success = 0;
-    if (direct_block >= 0 && direct_block <= NUM_DIRECT_BLOCK)
+    if (direct_block >= 0 && direct_block < NUM_BLOCK_POINTERS)
     {
-        if (num > bitmap.start_block && num <= bitmap.max_block)
+        if (num >= fs->bitmap.data_start && num <= fs->bitmap.max_block)
         {
-            // extra space for '\0'
-            char blocknum[NUM_BYTES_PER_ADDRESS + 1];
-            for (int i = 0; i <= NUM_BYTES_PER_ADDRESS; i++)
-            {
-                blocknum[i] = '\0';
-            }
-            sprintf(blocknum, "%d", num);
-            for (int i = 0; i < NUM_BYTES_PER_ADDRESS; i++)
-            {
-                inode_data[NUM_BYTES_FOR_SIZE + NUM_BYTES_FOR_BLOCKS + direct_block * NUM_BYTES_PER_ADDRESS + i] = blocknum[i];
-            }
+            inode->block_nums[direct_block] = htole32((uint32_t)num);
             success = 1;
         }
     }
     return success;
 }
 
-int get_block_num(char *inode_data, int index)
+int block_path(FileSystemInternals *fs, int index, int *slot, int *offsets)
 {
-    int blocknum = -1;
-
-    if (index < NUM_DIRECT_BLOCK)
-        blocknum = get_direct_block_num(inode_data, index);
-    else
+    const long NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    long i = index;
+    if (i < 0)
+        return -1;
+    if (i < NUM_DIRECT_BLOCK)
     {
-        int indirect_block_num = get_direct_block_num(inode_data, 12);
-        char block_data[SOFTWARE_DISK_BLOCK_SIZE];
-        read_sd_block(block_data, indirect_block_num);
-        const int NUM_ADDRESS_PER_BLOCK = SOFTWARE_DISK_BLOCK_SIZE / NUM_BYTES_PER_ADDRESS;
-        index = index - NUM_DIRECT_BLOCK;
-        if (index < NUM_ADDRESS_PER_BLOCK)
-        {
-            // extra space for '\0'
-            char num[NUM_BYTES_PER_ADDRESS + 1];
-            num[NUM_BYTES_PER_ADDRESS] = '\0';
-            for (int i = 0; i < NUM_BYTES_PER_ADDRESS; i++)
-            {
-                num[i] = block_data[index * NUM_BYTES_PER_ADDRESS + i];
-            }
-            blocknum = atoi(num);
-        }
+        *slot = i;
+        return 0;
     }
-    return blocknum;
-}
-
-int set_block_num(char *inode_data, int index, int num)
-{
-    int success = 0;
-    if (index < NUM_DIRECT_BLOCK)
+    i = i - NUM_DIRECT_BLOCK;
+    if (i < NUM_ADDRESS_PER_BLOCK)
     {
-        success = set_direct_block_num(inode_data, index, num);
+        *slot = SINGLE_INDIRECT;
+        offsets[0] = i;
+        return 1;
     }
-    else
+    i = i - NUM_ADDRESS_PER_BLOCK;
+    if (i < NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK)
     {
-        const int NUM_ADDRESS_PER_BLOCK = SOFTWARE_DISK_BLOCK_SIZE / NUM_BYTES_PER_ADDRESS;
-        index = index - NUM_DIRECT_BLOCK;
-        if (index < NUM_ADDRESS_PER_BLOCK)
-        {
-            if (num > bitmap.start_block && num <= bitmap.max_block)
-            {
-                int indirect_block_num = get_direct_block_num(inode_data, 12);
-                char block_data[SOFTWARE_DISK_BLOCK_SIZE];
-                read_sd_block(block_data, indirect_block_num);
-
-                // extra space for '\0'
-                char blocknum[NUM_BYTES_PER_ADDRESS + 1];
-                for (int i = 0; i <= NUM_BYTES_PER_ADDRESS; i++)
-                {
-                    blocknum[i] = '\0';
-                }
-                sprintf(blocknum, "%d", num);
-                for (int i = 0; i < NUM_BYTES_PER_ADDRESS; i++)
-                {
-                    block_data[index * NUM_BYTES_PER_ADDRESS + i] = blocknum[i];
-                }
-                success = write_sd_block(block_data, indirect_block_num);
-            }
-        }
+        *slot = DOUBLE_INDIRECT;
+        offsets[0] = i / NUM_ADDRESS_PER_BLOCK;
+        offsets[1] = i % NUM_ADDRESS_PER_BLOCK;
+        return 2;
     }
-    return success;
+    i = i - NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK;
+    if (i < NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK)
+    {
+        *slot = TRIPLE_INDIRECT;
+        offsets[0] = i / (NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK);
+        offsets[1] = i / NUM_ADDRESS_PER_BLOCK % NUM_ADDRESS_PER_BLOCK;
+        offsets[2] = i % NUM_ADDRESS_PER_BLOCK;
+        return 3;
+    }
+    return -1;
 }
 
-////////////// BITMAP OPERATIONS DEFINITION //////////////
-
-// set bit k_th in bitmap.map
-void set_bit(int k)
+int path_block_num(FileSystemInternals *fs, Inode *inode, int slot, int *offsets, int level)
 {
-    int i = k / 8;
-    int pos = k % 8;
-    unsigned char flag = 128;
-    flag = flag >> pos;
-    bitmap.map[i] = bitmap.map[i] | flag;
+    int blocknum = get_direct_block_num(inode, slot);
+    uint32_t block_data[fs->disk.block_size / NUM_BYTES_PER_ADDRESS];
+    for (int k = 0; k < level && blocknum > 0; k++)
+    {
+        if (!read_cache_block(&fs->cache, block_data, blocknum))
+            return 0;
+        blocknum = (int)le32toh(block_data[offsets[k]]);
+    }
+    return blocknum > 0 ? blocknum : 0;
 }
 
-// clear bit k_th in bitmap.map
-void clear_bit(int k)
+int is_extent_inode(Inode *inode)
 {
-    int i = k / 8;
-    int pos = k % 8;
-    unsigned char flag = 128;
-    flag = flag >> pos;
-    flag = ~flag;
-    bitmap.map[i] = bitmap.map[i] & flag;
+    return (le32toh(inode->flags) & INODE_EXTENTS) != 0;
 }
 
-int free_block(int index)
+int new_pointer_blocks(FileSystemInternals *fs, Inode *inode, int index)
 {
-    if (index > bitmap.start_block && index <= bitmap.max_block)
+    if (is_extent_inode(inode))
+        return 0;
+
+    // the pointer blocks whose entries on the path are all the first one are new
+    int slot;
+    int offsets[3];
+    int depth = block_path(fs, index, &slot, offsets);
+    int count = 0;
+    for (int level = depth - 1; level >= 0 && offsets[level] == 0; level--)
     {
-        int k = index - bitmap.start_block - 2;
-        set_bit(k);
+        count++;
+    }
+    return count;
+}
+
+int get_block_num(FileSystemInternals *fs, Inode *inode, int index)
+{
+    int slot;
+    int offsets[3];
+    int depth = block_path(fs, index, &slot, offsets);
+    if (depth == -1)
+        return -1;
+    if (depth == 0)
+        return get_direct_block_num(inode, slot);
+
+    int parent = path_block_num(fs, inode, slot, offsets, depth - 1);
+    if (parent == 0)
+        return -1;
+    uint32_t block_data[fs->disk.block_size / NUM_BYTES_PER_ADDRESS];
+    if (!read_cache_block(&fs->cache, block_data, parent))
+        return -1;
+    return (int)le32toh(block_data[offsets[depth - 1]]);
+}
+
+int set_block_num(FileSystemInternals *fs, Inode *inode, int index, int num)
+{
+    int slot;
+    int offsets[3];
+    int depth = block_path(fs, index, &slot, offsets);
+    if (depth == -1 || num < fs->bitmap.data_start || num > fs->bitmap.max_block)
+        return 0;
+    if (depth == 0)
+        return set_direct_block_num(fs, inode, slot, num);
+
+    int parent = path_block_num(fs, inode, slot, offsets, depth - 1);
+    if (parent == 0)
+        return 0;
+    uint32_t block_data[fs->disk.block_size / NUM_BYTES_PER_ADDRESS];
+    if (!read_cache_block(&fs->cache, block_data, parent))
+        return 0;
+    block_data[offsets[depth - 1]] = htole32((uint32_t)num);
+    return write_cache_block(&fs->cache, block_data, parent);
+}
+
+int free_file_blocks(FileSystemInternals *fs, Inode *inode)
+{
+    const long NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (is_extent_inode(inode))
+        return free_extent_blocks(fs, inode);
+
+    // holes are skipped, consecutive blocks are given back together
+    BlockRun freed = {0, 0, 0};
+    int count = 0;
+    int success = 1;
+    for (int i = 0; i < NUM_DIRECT_BLOCK; i++)
+    {
+        if (!add_to_free_run(fs, &freed, get_direct_block_num(inode, i)))
+            success = 0;
+    }
+    long first = NUM_DIRECT_BLOCK;
+    long span = NUM_ADDRESS_PER_BLOCK;
+    for (int depth = 1; depth <= 3; depth++)
+    {
+        int block_num = get_direct_block_num(inode, SINGLE_INDIRECT + depth - 1);
+        if (block_num >= fs->bitmap.data_start)
+        {
+            int gone = truncate_pointer_tree(fs, block_num, depth, first, 0, &freed, &count);
+            if (gone != 1 || !add_to_free_run(fs, &freed, block_num))
+                success = 0;
+        }
+        first += span;
+        span *= NUM_ADDRESS_PER_BLOCK;
+    }
+    return discard_blocks(fs, freed.next, freed.left) && success;
+}
+
+////////////// BITMAP OPERATIONS DEFINITION //////////////
+
+// set bit k_th in bitmap.words, return 1 when it was clear
+int set_bit(FileSystemInternals *fs, int k)
+{
+    uint64_t flag = (uint64_t)1 << (k % 64);
+    int was_clear = !(fs->bitmap.words[k / 64] & flag);
+    fs->bitmap.words[k / 64] |= flag;
+    return was_clear;
+}
+
+// clear bit k_th in bitmap.words, return 1 when it was set
+int clear_bit(FileSystemInternals *fs, int k)
+{
+    uint64_t flag = (uint64_t)1 << (k % 64);
+    int was_set = (fs->bitmap.words[k / 64] & flag) != 0;
+    fs->bitmap.words[k / 64] &= ~flag;
+    return was_set;
+}
+
+// return b with its bits in reverse order, the on disk map is MSB first
+unsigned char reverse_byte(unsigned char b)
+{
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+void mark_bitmap_dirty(FileSystemInternals *fs, int first, int last)
+{
+    start_metadata_timer(fs);
+    for (int b = first / 8 / fs->disk.block_size; b <= last / 8 / fs->disk.block_size; b++)
+    {
+        fs->bitmap.dirty[b] = 1;
+    }
+}
+
+int free_block(FileSystemInternals *fs, int index)
+{
+    if (index >= fs->bitmap.data_start && index <= fs->bitmap.max_block)
+    {
+        int k = index - fs->bitmap.data_start;
+        fs->bitmap.free_blocks += set_bit(fs, k);
+        mark_bitmap_dirty(fs, k, k);
         return 1;
     }
     return 0;
 }
 
-int set_block(int index)
+int set_block(FileSystemInternals *fs, int index)
 {
-    if (index > bitmap.start_block && index <= bitmap.max_block)
+    if (index >= fs->bitmap.data_start && index <= fs->bitmap.max_block)
     {
-        int k = index - bitmap.start_block - 2;
-        clear_bit(k);
+        int k = index - fs->bitmap.data_start;
+        fs->bitmap.free_blocks -= clear_bit(fs, k);
+        mark_bitmap_dirty(fs, k, k);
         return 1;
     }
     return 0;
 }
 
-int get_free_block()
+int get_free_block(FileSystemInternals *fs)
 {
-    const int WORD_SIZE = 8;
-    int number_zero_word = 0;
-    int non_zero_word = 0;
+    int got = 0;
+    return get_free_blocks(fs, 1, &got);
+}
 
-    // find non_zero_word and count zero_word
-    for (int i = 0; i < bitmap.size; i++)
+// set bits first to first + count - 1 in bitmap.words when set_bits, otherwise clear them,
+// a word at a time, return the number of bits that changed
+int change_bits(FileSystemInternals *fs, int first, int count, int set_bits)
+{
+    int changed = 0;
+    int k = first;
+    while (k < first + count)
     {
-        if (bitmap.map[i] == 0)
-            number_zero_word++;
+        int pos = k % 64;
+        int take = 64 - pos < first + count - k ? 64 - pos : first + count - k;
+        uint64_t mask = take == 64 ? ~(uint64_t)0 : (((uint64_t)1 << take) - 1) << pos;
+        uint64_t *word = &fs->bitmap.words[k / 64];
+        if (set_bits)
+        {
+            changed += __builtin_popcountll(~*word & mask);
+            *word |= mask;
+        }
         else
         {
-            non_zero_word = bitmap.map[i];
-            break;
+            changed += __builtin_popcountll(*word & mask);
+            *word &= ~mask;
         }
+        k += take;
     }
+    return changed;
+}
+
+int get_free_blocks(FileSystemInternals *fs, int count, int *got)
+{
+    *got = 0;
+    if (fs->bitmap.free_blocks == 0 || count <= 0)
+        return -1;
 
-    // find the offset to the first bit in non_zero_word
-    int offset = 1;
-    unsigned char check = 128;
-    for (int i = 0; i < WORD_SIZE; i++)
+    // next fit for a run of count free blocks, a word at a time from the cursor on, wrapping
+    // around. A run can't wrap, and without a long enough one the longest is taken
+    int run_first = 0;
+    int run_len = 0;
+    int best_first = 0;
+    int best_len = 0;
+    for (int n = 0; n < fs->bitmap.num_words && run_len < count; n++)
     {
-        if (!(non_zero_word & (check >> i)))
-            offset++;
-        else
-            break;
+        int w = (fs->bitmap.cursor + n) % fs->bitmap.num_words;
+        if (w == 0)
+            run_len = 0;
+        uint64_t bits = fs->bitmap.words[w];
+        int pos = 0;
+        while (pos < 64 && run_len < count)
+        {
+            uint64_t rest = bits >> pos;
+            if (rest == 0)
+            {
+                run_len = 0;
+                break;
+            }
+            int used = __builtin_ctzll(rest);
+            if (used > 0)
+            {
+                run_len = 0;
+                pos += used;
+                rest >>= used;
+            }
+            int ones = ~rest == 0 ? 64 - pos : __builtin_ctzll(~rest);
+            if (run_len == 0)
+                run_first = w * 64 + pos;
+            run_len += ones;
+            pos += ones;
+            if (run_len > best_len)
+            {
+                best_first = run_first;
+                best_len = run_len;
+            }
+        }
     }
+    int n = best_len < count ? best_len : count;
+    change_bits(fs, best_first, n, 0);
+    fs->bitmap.free_blocks -= n;
+    fs->bitmap.cursor = (best_first + n) / 64 % fs->bitmap.num_words;
+    mark_bitmap_dirty(fs, best_first, best_first + n - 1);
+    *got = n;
+    return best_first + fs->bitmap.data_start;
+}
 
-    int block_number = (WORD_SIZE * number_zero_word + offset) + bitmap.start_block + 1;
-    if (block_number > 4999)
-        return -1;
-    else
+void free_block_run(FileSystemInternals *fs, int first, int count)
+{
+    if (count <= 0 || first < fs->bitmap.data_start || first + count - 1 > fs->bitmap.max_block)
+        return;
+    int k = first - fs->bitmap.data_start;
+    fs->bitmap.free_blocks += change_bits(fs, k, count, 1);
+    mark_bitmap_dirty(fs, k, k + count - 1);
+}
+
+int take_block(FileSystemInternals *fs, BlockRun *run)
+{
+    if (run->left == 0)
     {
-        set_block(block_number);
-        return block_number;
+        run->next = get_free_blocks(fs, run->wanted > 0 ? run->wanted : 1, &run->left);
+        if (run->next == -1)
+            return -1;
     }
+    run->left--;
+    if (run->wanted > 0)
+        run->wanted--;
+    return run->next++;
 }
 
-int write_bitmap_to_disk()
+void release_run(FileSystemInternals *fs, BlockRun *run)
 {
-    int success = 0;
-    char temp[bitmap.blocks_for_map * SOFTWARE_DISK_BLOCK_SIZE];
-    for (int i = 0; i < bitmap.size; i++)
+    free_block_run(fs, run->next, run->left);
+    run->left = 0;
+}
+
+int add_to_free_run(FileSystemInternals *fs, BlockRun *run, int index)
+{
+    if (index < fs->bitmap.data_start || index > fs->bitmap.max_block)
+        return 1;
+    if (run->left > 0 && run->next + run->left == index)
+    {
+        run->left++;
+        return 1;
+    }
+    int success = discard_blocks(fs, run->next, run->left);
+    run->next = index;
+    run->left = 1;
+    return success;
+}
+
+int discard_blocks(FileSystemInternals *fs, int first, int count)
+{
+    if (count <= 0 || first < fs->bitmap.data_start || first + count - 1 > fs->bitmap.max_block)
+        return 1;
+    if (fs->scrub_policy != SCRUB_SYNC)
+    {
+        free_block_run(fs, first, count);
+        return 1;
+    }
+    if (fs->zero_block == NULL)
+        fs->zero_block = calloc(1, fs->disk.block_size);
+    if (fs->zero_block == NULL)
+        return 0;
+
+    // the zeros go through the block cache in vectored writes, all from the same block. The
+    // blocks of a write that fails keep their old data, so they aren't handed out again
+    int success = 1;
+    SDBlockIO ios[TRANSFER_BLOCKS];
+    for (int done = 0; done < count; done += TRANSFER_BLOCKS)
+    {
+        int n = count - done < TRANSFER_BLOCKS ? count - done : TRANSFER_BLOCKS;
+        for (int i = 0; i < n; i++)
+        {
+            ios[i].blocknum = first + done + i;
+            ios[i].buf = fs->zero_block;
+        }
+        if (write_cache_blocks(&fs->cache, ios, n))
+            free_block_run(fs, first + done, n);
+        else
+            success = 0;
+    }
+    return success;
+}
+
+void free_all_blocks(FileSystemInternals *fs)
+{
+    memset(fs->bitmap.words, 0, fs->bitmap.num_words * sizeof(uint64_t));
+    for (int w = 0; w < fs->bitmap.num_words; w++)
     {
-        temp[i] = bitmap.map[i];
+        int bits = fs->bitmap.num_bits - w * 64;
+        fs->bitmap.words[w] = bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
     }
-    for (int i = 0; i < bitmap.blocks_for_map; i++)
+    fs->bitmap.free_blocks = fs->bitmap.num_bits;
+    fs->bitmap.cursor = 0;
+    memset(fs->bitmap.dirty, 1, fs->bitmap.blocks_for_map);
+}
+
+int write_bitmap_to_disk(FileSystemInternals *fs)
+{
+    int success = 1;
+    unsigned char temp[fs->disk.block_size];
+    for (int b = 0; b < fs->bitmap.blocks_for_map; b++)
     {
-        success = write_sd_block(temp + i * SOFTWARE_DISK_BLOCK_SIZE, (unsigned long)bitmap.start_block + i);
+        if (!fs->bitmap.dirty[b])
+            continue;
+        memset(temp, 0, fs->disk.block_size);
+        for (int j = 0; j < fs->disk.block_size; j++)
+        {
+            int i = b * fs->disk.block_size + j;
+            if (i >= fs->bitmap.size || i / 8 >= fs->bitmap.num_words)
+                break;
+            temp[j] = reverse_byte((unsigned char)(fs->bitmap.words[i / 8] >> (i % 8 * 8)));
+        }
+        success = write_cache_block(&fs->cache, temp, (unsigned long)fs->bitmap.start_block + b);
         if (!success)
             break;
+        fs->bitmap.dirty[b] = 0;
     }
     return success;
 }
 
-int load_bitmap_from_disk()
+int load_bitmap_from_disk(FileSystemInternals *fs)
 {
     int success = 0;
-    char temp[bitmap.blocks_for_map * SOFTWARE_DISK_BLOCK_SIZE];
+    unsigned char temp[fs->bitmap.blocks_for_map * fs->disk.block_size];
 
-    for (int i = 0; i < bitmap.blocks_for_map; i++)
+    for (int i = 0; i < fs->bitmap.blocks_for_map; i++)
     {
-        success = read_sd_block(temp + i * SOFTWARE_DISK_BLOCK_SIZE, (unsigned long)bitmap.start_block + i);
+        success = read_cache_block(&fs->cache, temp + i * fs->disk.block_size, (unsigned long)fs->bitmap.start_block + i);
         if (!success)
             break;
     }
-    for (int i = 0; i < bitmap.size; i++)
+    memset(fs->bitmap.words, 0, fs->bitmap.num_words * sizeof(uint64_t));
+    for (int i = 0; i < fs->bitmap.size && i / 8 < fs->bitmap.num_words; i++)
     {
-        bitmap.map[i] = temp[i];
+        fs->bitmap.words[i / 8] |= (uint64_t)reverse_byte(temp[i]) << (i % 8 * 8);
     }
+
+    // older maps have the bits past the data blocks set
+    int tail = fs->bitmap.num_bits % 64;
+    if (tail != 0)
+        fs->bitmap.words[fs->bitmap.num_words - 1] &= ((uint64_t)1 << tail) - 1;
+    fs->bitmap.free_blocks = 0;
+    for (int w = 0; w < fs->bitmap.num_words; w++)
+    {
+        fs->bitmap.free_blocks += __builtin_popcountll(fs->bitmap.words[w]);
+    }
+    fs->bitmap.cursor = 0;
+    memset(fs->bitmap.dirty, 0, fs->bitmap.blocks_for_map);
     return success;
 }
 
 // init bitmap structure
-int init_bitmap()
+int init_bitmap(FileSystemInternals *fs)
 {
     int success = 0;
-    bitmap.start_block = dir.num_blocks_for_Dir + inodes.num_blocks_for_inodes;
-    bitmap.max_block = 4999;
-    int num_blocks = 5000 - bitmap.start_block - 1;
-    bitmap.size = (num_blocks % 8) == 0 ? num_blocks / 8 : num_blocks / 8 + 1;
-    // allocate bitmap.map
-    free(bitmap.map);
-    bitmap.map = malloc(bitmap.size);
-    bitmap.blocks_for_map = (bitmap.size & SOFTWARE_DISK_BLOCK_SIZE) == 0 ? bitmap.size / SOFTWARE_DISK_BLOCK_SIZE : bitmap.size / SOFTWARE_DISK_BLOCK_SIZE + 1;
     // NO file exists, every block is available, set all to 1
-    if (inodes.size == 0)
+    if (fs->inodes.size == 0)
     {
-        for (int i = 0; i < bitmap.size; i++)
-        {
-            bitmap.map[i] = -1;
-        }
+        free_all_blocks(fs);
         success = 1;
     }
     else
     {
-        success = load_bitmap_from_disk();
+        success = load_bitmap_from_disk(fs);
     }
 
     return success;
 }
 
-//////////////////////////////// MAIN INTERFACE ////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
+////////////// FORMAT OPERATIONS DEFINITION //////////////
 
-void init_fs()
+int parse_ascii_number(char *field, int width)
 {
-    int success = 0;
-
-    // init dir
-    success = init_dir();
-    if (!success)
-        printf("Something wrong with dir init!\n");
-
-    // init inodes
-    success = init_inodes();
-    if (!success)
-        printf("Something wrong with inodes init!\n");
+    char num[width + 1];
+    memcpy(num, field, width);
+    num[width] = '\0';
+    return atoi(num);
+}
 
-    // init inodes
-    success = init_bitmap();
-    if (!success)
-        printf("Something wrong with bitmap init!\n");
-    fserror = FS_NONE;
+int write_superblock(FileSystemInternals *fs)
+{
+    char buf[fs->disk.block_size];
+    SuperBlock sb;
+    memset(buf, 0, fs->disk.block_size);
+    memcpy(sb.magic, FS_MAGIC, sizeof(sb.magic));
+    sb.version = htole32(FS_VERSION);
+    sb.block_size = htole32(fs->disk.block_size);
+    sb.num_blocks = htole64(fs->disk.num_blocks);
+    sb.num_files = htole32(NUM_FILES);
+    sb.dir_start = htole32(fs->dir.start_block);
+    sb.inodes_start = htole32(fs->inodes.start_block);
+    sb.bitmap_start = htole32(fs->bitmap.start_block);
+    sb.data_start = htole32(fs->bitmap.data_start);
+    memcpy(buf, &sb, sizeof(sb));
+    return write_cache_block(&fs->cache, buf, SUPERBLOCK);
 }
 
-File open_file(char *name, FileMode mode)
+int migrate_ascii_format(FileSystemInternals *fs)
 {
-    if (!is_init)
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    // old layout: dir from block 0, then the inodes, both 64 byte records
+    const int old_per_block = fs->disk.block_size / ASCII_ENTRY_SIZE;
+    const int old_inodes_start = (NUM_FILES + old_per_block - 1) / old_per_block;
+    char buf[fs->disk.block_size];
+    int success = 1;
+
+    // decoded single indirect block of each file, and the blocks in use
+    uint32_t *indirect = calloc((size_t)NUM_FILES * NUM_ADDRESS_PER_BLOCK, sizeof(uint32_t));
+    char *used = calloc(fs->disk.num_blocks, 1);
+    if (indirect == NULL || used == NULL)
+        success = 0;
+
+    // decode the ASCII entries and inodes into the binary structures
+    memset(fs->dir.entries, 0, sizeof(fs->dir.entries));
+    memset(fs->inodes.list_inodes, 0, sizeof(fs->inodes.list_inodes));
+    for (int i = 0; success && i < NUM_FILES; i++)
     {
-        is_init = 1;
-        init_fs();
-    }
-    int f_no = get_entry(name);
-    if (f_no == -1)
-    {
-        fserror = FS_FILE_NOT_FOUND;
-        return NULL;
+        success = read_cache_block(&fs->cache, buf, i / old_per_block);
+        char *old_entry = buf + (i % old_per_block) * ASCII_ENTRY_SIZE;
+        if (!success || old_entry[0] == '\0')
+            continue;
+        strncpy(fs->dir.entries[i].name, old_entry, MAX_NAME_LENGTH);
+        int file_no = parse_ascii_number(old_entry + ASCII_ENTRY_SIZE - ASCII_BYTES_PER_FILENO, ASCII_BYTES_PER_FILENO);
+        fs->dir.entries[i].file_no = htole16(file_no);
     }
-    else
+    for (int i = 0; success && i < NUM_FILES; i++)
     {
-        if (is_opened(f_no))
+        success = read_cache_block(&fs->cache, buf, old_inodes_start + i / old_per_block);
+        char *old_inode = buf + (i % old_per_block) * ASCII_INODE_SIZE;
+        if (!success || old_inode[0] == '\0')
+            continue;
+        Inode *inode = &fs->inodes.list_inodes[i];
+        int blocks = parse_ascii_number(old_inode + ASCII_BYTES_FOR_SIZE, ASCII_BYTES_FOR_BLOCKS);
+        if (blocks > NUM_DIRECT_BLOCK + NUM_ADDRESS_PER_BLOCK)
+            blocks = NUM_DIRECT_BLOCK + NUM_ADDRESS_PER_BLOCK;
+        inode->flags = htole32(INODE_USED);
+        inode->size = htole64(parse_ascii_number(old_inode, ASCII_BYTES_FOR_SIZE));
+        inode->blocks = htole32(blocks);
+        // a block number in a slot past the blocks would read as a block of the file, not a hole
+        for (int k = 0; k <= NUM_DIRECT_BLOCK; k++)
         {
-            fserror = FS_FILE_OPEN;
-            return NULL;
+            char *field = old_inode + ASCII_BYTES_FOR_SIZE + ASCII_BYTES_FOR_BLOCKS + k * NUM_BYTES_PER_ADDRESS;
+            if (k < NUM_DIRECT_BLOCK ? k < blocks : blocks > NUM_DIRECT_BLOCK)
+                inode->block_nums[k] = htole32(parse_ascii_number(field, NUM_BYTES_PER_ADDRESS));
         }
-        else
+        if (blocks > NUM_DIRECT_BLOCK)
         {
-            fserror = FS_NONE;
-            File opened_file = (File)malloc(sizeof(struct FileInternals));
-            opened_file->file_no = f_no;
-            add_to_opened_files(f_no);
-            opened_file->cur_pos = 0;
-            opened_file->mode = mode;
-            return opened_file;
+            success = read_cache_block(&fs->cache, buf, le32toh(inode->block_nums[NUM_DIRECT_BLOCK]));
+            for (int k = 0; success && k < blocks - NUM_DIRECT_BLOCK; k++)
+            {
+                indirect[i * NUM_ADDRESS_PER_BLOCK + k] = parse_ascii_number(buf + k * NUM_BYTES_PER_ADDRESS, NUM_BYTES_PER_ADDRESS);
+            }
         }
     }
-}
 
-File create_file(char *name)
-{
-    if (!is_init)
+    // every block number of every file, the indirect block included
+    int num_refs = 0;
+    uint32_t **refs = success ? malloc((size_t)NUM_FILES * (NUM_DIRECT_BLOCK + 1 + NUM_ADDRESS_PER_BLOCK) * sizeof(uint32_t *)) : NULL;
+    if (refs == NULL)
+        success = 0;
+    for (int i = 0; success && i < NUM_FILES; i++)
     {
-        is_init = 1;
-        init_fs();
+        Inode *inode = &fs->inodes.list_inodes[i];
+        int blocks = get_blocks_in_inode(inode);
+        for (int k = 0; k < blocks && k < NUM_DIRECT_BLOCK; k++)
+        {
+            refs[num_refs++] = &inode->block_nums[k];
+        }
+        if (blocks > NUM_DIRECT_BLOCK)
+            refs[num_refs++] = &inode->block_nums[NUM_DIRECT_BLOCK];
+        for (int k = 0; k < blocks - NUM_DIRECT_BLOCK; k++)
+        {
+            refs[num_refs++] = &indirect[i * NUM_ADDRESS_PER_BLOCK + k];
+        }
     }
-    // check filename already exsit
-    int ret = get_entry(name);
-    if (ret != -1)
+    for (int r = 0; success && r < num_refs; r++)
     {
-        fserror = FS_FILE_ALREADY_EXISTS;
-        return NULL;
+        uint32_t num = le32toh(*refs[r]);
+        if (num == 0 || num >= (uint32_t)fs->disk.num_blocks)
+            success = 0;
+        else
+            used[num] = 1;
     }
-    int f_no = add_entry(name);
-    if (f_no != -1)
+
+    // the binary metadata is larger: move the data blocks now inside it
+    int next_free = fs->bitmap.data_start;
+    for (int r = 0; success && r < num_refs; r++)
     {
-        fserror = FS_NONE;
-        FileInternals *created_file = malloc(sizeof(struct FileInternals));
-        created_file->file_no = f_no;
-        add_to_opened_files(f_no);
-        created_file->cur_pos = 0;
-        created_file->mode = READ_WRITE;
-        return created_file;
+        int num = le32toh(*refs[r]);
+        if (num >= fs->bitmap.data_start)
+            continue;
+        while (next_free < fs->disk.num_blocks && used[next_free])
+        {
+            next_free++;
+        }
+        if (next_free >= fs->disk.num_blocks)
+        {
+            success = 0;
+            break;
+        }
+        success = read_cache_block(&fs->cache, buf, num) && write_cache_block(&fs->cache, buf, next_free);
+        used[next_free] = 1;
+        *refs[r] = htole32(next_free);
     }
-    return NULL;
-}
 
-void close_file(File file)
-{
-    if (!is_init)
+    // indirect blocks, bitmap, dir and inodes in the binary format, superblock last
+    for (int i = 0; success && i < NUM_FILES; i++)
     {
-        is_init = 1;
-        init_fs();
+        Inode *inode = &fs->inodes.list_inodes[i];
+        if (get_blocks_in_inode(inode) <= NUM_DIRECT_BLOCK)
+            continue;
+        uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+        for (int k = 0; k < NUM_ADDRESS_PER_BLOCK; k++)
+        {
+            block_data[k] = htole32(indirect[i * NUM_ADDRESS_PER_BLOCK + k]);
+        }
+        success = write_cache_block(&fs->cache, block_data, get_direct_block_num(inode, NUM_DIRECT_BLOCK));
     }
-    if (file != NULL)
+    if (success)
     {
-        if (is_opened(file->file_no))
+        free_all_blocks(fs);
+        for (int b = fs->bitmap.data_start; b <= fs->bitmap.max_block; b++)
         {
-            delete_from_opened_files(file->file_no);
-            free(file);
-            fserror = FS_NONE;
+            if (used[b])
+                set_block(fs, b);
         }
-        else
-            fserror = FS_FILE_NOT_OPEN;
+        success = write_bitmap_to_disk(fs);
     }
-    else
-        fserror = FS_IO_ERROR;
-}
-
-unsigned long read_file(File file, void *buf, unsigned long numbytes)
-{
-    if (!is_init)
+    for (int z = 0; success && z < fs->dir.num_blocks_for_Dir; z++)
     {
-        is_init = 1;
-        init_fs();
+        memset(buf, 0, fs->disk.block_size);
+        for (int i = 0; i < fs->dir.num_entries_per_block && z * fs->dir.num_entries_per_block + i < NUM_FILES; i++)
+        {
+            memcpy(buf + i * ENTRY_SIZE, &fs->dir.entries[z * fs->dir.num_entries_per_block + i], ENTRY_SIZE);
+        }
+        success = write_cache_block(&fs->cache, buf, fs->dir.start_block + z);
     }
-    if (file != NULL)
+    for (int z = 0; success && z < fs->inodes.num_blocks_for_inodes; z++)
     {
-        if (is_opened(file->file_no))
+        memset(buf, 0, fs->disk.block_size);
+        for (int i = 0; i < fs->inodes.num_inodes_per_block && z * fs->inodes.num_inodes_per_block + i < NUM_FILES; i++)
         {
-            // get the inode
-            char file_inode[INODE_SIZE];
-            int success = read_inode(file_inode, file->file_no);
-            if (!success)
-                printf("invalid file number!\n");
-
-            // get file_size from inode
-            int file_size = get_size_in_inode(file_inode);
-            int eof_pos = file_size > 0 ? (file_size - 1) : 0;
+            memcpy(buf + i * INODE_SIZE, &fs->inodes.list_inodes[z * fs->inodes.num_inodes_per_block + i], INODE_SIZE);
+        }
+        success = write_cache_block(&fs->cache, buf, fs->inodes.start_block + z);
+    }
+    if (success)
+        success = flush_cache(&fs->cache) && write_superblock(fs) && flush_cache(&fs->cache) && sd_sync(fs->sd);
 
-            // numbytes to be read
-            int numbytes_read = 0;
-            if ((file->cur_pos + numbytes - 1) < file_size)
-            {
-                numbytes_read = numbytes;
-            }
-            else
-            {
-                numbytes_read = file_size - file->cur_pos - 1;
-            }
+    free(refs);
+    free(used);
+    free(indirect);
+    return success;
+}
 
-            // calculate the number of blocks will be loaded
-            int LOADED_BLOCKS = 0;
-            int remain_bytes = SOFTWARE_DISK_BLOCK_SIZE - eof_pos % SOFTWARE_DISK_BLOCK_SIZE;
-            if (file_size > 0)
-            {
-                if (numbytes_read <= remain_bytes)
-                    LOADED_BLOCKS = 1;
-                else
-                    LOADED_BLOCKS = (numbytes_read - remain_bytes) / SOFTWARE_DISK_BLOCK_SIZE + 1;
-            }
-            else
-                LOADED_BLOCKS = (numbytes_read - 1) / SOFTWARE_DISK_BLOCK_SIZE + 1;
+int init_format(FileSystemInternals *fs)
+{
+    char buf[fs->disk.block_size];
+    SuperBlock sb;
+    if (fs->disk.num_blocks == 0 || !read_cache_block(&fs->cache, buf, SUPERBLOCK))
+        return 0;
+    memcpy(&sb, buf, sizeof(sb));
+    if (memcmp(sb.magic, FS_MAGIC, sizeof(sb.magic)) != 0)
+        return migrate_ascii_format(fs);
+
+    // another version or layout can't be mounted by this code
+    return le32toh(sb.version) == FS_VERSION &&
+           le32toh(sb.block_size) == (uint32_t)fs->disk.block_size &&
+           le64toh(sb.num_blocks) == (uint64_t)fs->disk.num_blocks &&
+           le32toh(sb.num_files) == NUM_FILES &&
+           le32toh(sb.dir_start) == (uint32_t)fs->dir.start_block &&
+           le32toh(sb.inodes_start) == (uint32_t)fs->inodes.start_block &&
+           le32toh(sb.bitmap_start) == (uint32_t)fs->bitmap.start_block &&
+           le32toh(sb.data_start) == (uint32_t)fs->bitmap.data_start;
+}
 
-            // array of block numbers for read_file
-            int indexes[LOADED_BLOCKS];
+////////////// HANDLE OPERATIONS DEFINITION //////////////
 
-            // start_block index
-            int start_block = file->cur_pos / SOFTWARE_DISK_BLOCK_SIZE;
-            // end_block index
-            int end_block = start_block + LOADED_BLOCKS - 1;
+FileInternals *alloc_handle(FileSystemInternals *fs)
+{
+    if (fs->free_handles == NULL)
+    {
+        HandleChunk *chunk = malloc(sizeof(HandleChunk));
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = fs->handle_chunks;
+        fs->handle_chunks = chunk;
+        for (int i = HANDLE_CHUNK - 1; i >= 0; i--)
+        {
+            chunk->handles[i].is_open = 0;
+            chunk->handles[i].map.indirect = NULL;
+            chunk->handles[i].map.leaf = NULL;
+            memset(&chunk->handles[i].extent_map, 0, sizeof(ExtentMap));
+            chunk->handles[i].wbuf.data = NULL;
+            chunk->handles[i].wbuf.allocated = 0;
+            chunk->handles[i].borrowed.blocks = NULL;
+            chunk->handles[i].borrowed.allocated = 0;
+            chunk->handles[i].next_free = fs->free_handles;
+            fs->free_handles = &chunk->handles[i];
+        }
+    }
+    FileInternals *file = fs->free_handles;
+    fs->free_handles = file->next_free;
+    file->fs = fs;
+    file->is_open = 1;
+    file->next_free = NULL;
+    file->map.num_indirect = 0;
+    file->map.dirty = 0;
+    file->map.leaf_block = 0;
+    file->map.leaf_dirty = 0;
+    file->map.end = -1;
+    file->extent_map.loaded = 0;
+    file->wbuf.size = 0;
+    file->wbuf.len = 0;
+    memset(&file->ra, 0, sizeof(ReadAhead));
+    file->borrowed.count = 0;
+    return file;
+}
 
-            for (int i = start_block; i <= end_block; i++)
-            {
-                indexes[i - start_block] = get_block_num(file_inode, i);
-            }
+void release_handle(FileSystemInternals *fs, FileInternals *file)
+{
+    file->is_open = 0;
+    file->next_free = fs->free_handles;
+    fs->free_handles = file;
+}
 
-            // read data into buf
-            char *charBuf = (char *)buf;
-            int cur_pos = file->cur_pos % SOFTWARE_DISK_BLOCK_SIZE;
-            if (LOADED_BLOCKS == 1)
-            {
-                char data[SOFTWARE_DISK_BLOCK_SIZE];
-                read_sd_block(data, indexes[0]);
-                for (int i = 0; i < numbytes_read; i++)
-                {
-                    charBuf[i] = data[cur_pos + i];
-                }
-                return numbytes_read;
-            }
-            else
-            {
-                // handle 1st block
-                char data[SOFTWARE_DISK_BLOCK_SIZE];
-                read_sd_block(data, indexes[0]);
-                for (int i = 0; i < SOFTWARE_DISK_BLOCK_SIZE - cur_pos; i++)
-                {
-                    charBuf[i] = data[cur_pos + i];
-                }
+void free_handles(FileSystemInternals *fs)
+{
+    while (fs->handle_chunks != NULL)
+    {
+        HandleChunk *next = fs->handle_chunks->next;
+        for (int i = 0; i < HANDLE_CHUNK; i++)
+        {
+            free(fs->handle_chunks->handles[i].map.indirect);
+            free(fs->handle_chunks->handles[i].map.leaf);
+            free(fs->handle_chunks->handles[i].extent_map.extents);
+            free(fs->handle_chunks->handles[i].extent_map.chain);
+            free(fs->handle_chunks->handles[i].wbuf.data);
+            free(fs->handle_chunks->handles[i].borrowed.blocks);
+        }
+        free(fs->handle_chunks);
+        fs->handle_chunks = next;
+    }
+    fs->free_handles = NULL;
+}
 
-                // handle inner blocks
-                int next_pos = SOFTWARE_DISK_BLOCK_SIZE - cur_pos;
-                for (int i = 1; i < LOADED_BLOCKS - 1; i++)
-                {
-                    read_sd_block(charBuf + next_pos + (i - 1) * SOFTWARE_DISK_BLOCK_SIZE, indexes[i]);
-                }
+////////////// BLOCK MAP OPERATIONS DEFINITION //////////////
 
-                // handle last block
-                read_sd_block(data, indexes[LOADED_BLOCKS - 1]);
-                int end_pos = (numbytes_read - next_pos) % SOFTWARE_DISK_BLOCK_SIZE;
-                int end_index = end_pos == 0 ? SOFTWARE_DISK_BLOCK_SIZE : end_pos;
-                for (int i = 0; i < end_index; i++)
-                {
-                    charBuf[next_pos + (LOADED_BLOCKS - 2) * SOFTWARE_DISK_BLOCK_SIZE + i] = data[i];
-                }
-                file->cur_pos = file->cur_pos + numbytes_read;
-                return numbytes_read;
-            }
-        }
-        else
-        {
-            fserror = FS_FILE_NOT_OPEN;
+int load_block_map(FileSystemInternals *fs, FileInternals *file, Inode *inode)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (file->map.indirect == NULL)
+    {
+        file->map.indirect = malloc(NUM_ADDRESS_PER_BLOCK * sizeof(int));
+        if (file->map.indirect == NULL)
             return 0;
-        }
     }
-    else
+    file->map.num_indirect = 0;
+    file->map.dirty = 0;
+
+    // without an indirect block its blocks are all holes
+    int indirect_block_num = get_direct_block_num(inode, SINGLE_INDIRECT);
+    if (indirect_block_num == 0)
     {
-        fserror = FS_IO_ERROR;
+        memset(file->map.indirect, 0, NUM_ADDRESS_PER_BLOCK * sizeof(int));
+        file->map.num_indirect = NUM_ADDRESS_PER_BLOCK;
+        return 1;
+    }
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    if (!read_cache_block(&fs->cache, block_data, indirect_block_num))
         return 0;
+    for (int i = 0; i < NUM_ADDRESS_PER_BLOCK; i++)
+    {
+        file->map.indirect[i] = (int)le32toh(block_data[i]);
     }
+    file->map.num_indirect = NUM_ADDRESS_PER_BLOCK;
+    return 1;
 }
 
-unsigned long write_file(File file, void *buf, unsigned long numbytes)
+int new_block_map(FileSystemInternals *fs, FileInternals *file)
 {
-    if (!is_init)
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (file->map.indirect == NULL)
+    {
+        file->map.indirect = malloc(NUM_ADDRESS_PER_BLOCK * sizeof(int));
+        if (file->map.indirect == NULL)
+            return 0;
+    }
+    memset(file->map.indirect, 0, NUM_ADDRESS_PER_BLOCK * sizeof(int));
+    file->map.num_indirect = NUM_ADDRESS_PER_BLOCK;
+    file->map.dirty = 1;
+    return 1;
+}
+
+int load_leaf(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    int slot;
+    int offsets[3];
+    int depth = block_path(fs, index, &slot, offsets);
+    if (depth < 2)
+        return -1;
+    int first = index - offsets[depth - 1];
+    if (file->map.leaf_block != 0 && file->map.leaf_first == first)
+        return 1;
+
+    int leaf_block = path_block_num(fs, inode, slot, offsets, depth - 1);
+    if (leaf_block == 0)
+        return 0;
+    if (!write_leaf(fs, file))
+        return -1;
+    if (file->map.leaf == NULL)
+    {
+        file->map.leaf = malloc(NUM_ADDRESS_PER_BLOCK * sizeof(int));
+        if (file->map.leaf == NULL)
+            return -1;
+    }
+    file->map.leaf_block = 0;
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    if (!read_cache_block(&fs->cache, block_data, leaf_block))
+        return -1;
+    for (int i = 0; i < NUM_ADDRESS_PER_BLOCK; i++)
+    {
+        file->map.leaf[i] = (int)le32toh(block_data[i]);
+    }
+    file->map.leaf_block = leaf_block;
+    file->map.leaf_first = first;
+    return 1;
+}
+
+int write_leaf(FileSystemInternals *fs, FileInternals *file)
+{
+    if (!file->map.leaf_dirty)
+        return 1;
+
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    for (int i = 0; i < NUM_ADDRESS_PER_BLOCK; i++)
+    {
+        block_data[i] = htole32((uint32_t)file->map.leaf[i]);
+    }
+    int success = write_cache_block(&fs->cache, block_data, file->map.leaf_block);
+    if (success)
+        file->map.leaf_dirty = 0;
+    return success;
+}
+
+int map_block_num(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (is_extent_inode(inode))
+        return extent_block_num(fs, &file->extent_map, inode, index);
+    if (file->map.end >= 0 && index >= file->map.end)
+        return 0;
+    if (index < NUM_DIRECT_BLOCK)
+        return get_direct_block_num(inode, index);
+    if (index >= NUM_DIRECT_BLOCK + NUM_ADDRESS_PER_BLOCK)
+    {
+        // no pointer block on the way means a hole
+        int loaded = load_leaf(fs, file, inode, index);
+        if (loaded <= 0)
+            return loaded;
+        return file->map.leaf[index - file->map.leaf_first];
+    }
+    index = index - NUM_DIRECT_BLOCK;
+
+    if (file->map.num_indirect == 0)
+    {
+        if (!load_block_map(fs, file, inode))
+            return -1;
+    }
+    return file->map.indirect[index];
+}
+
+int map_set_block_num(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index, int num)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (index < NUM_DIRECT_BLOCK)
+        return set_direct_block_num(fs, inode, index, num);
+    if (num < fs->bitmap.data_start || num > fs->bitmap.max_block)
+        return 0;
+    if (index >= NUM_DIRECT_BLOCK + NUM_ADDRESS_PER_BLOCK)
+    {
+        if (load_leaf(fs, file, inode, index) != 1)
+            return 0;
+        file->map.leaf[index - file->map.leaf_first] = num;
+        file->map.leaf_dirty = 1;
+        return 1;
+    }
+    index = index - NUM_DIRECT_BLOCK;
+
+    if (file->map.num_indirect == 0)
+    {
+        if (!load_block_map(fs, file, inode))
+            return 0;
+    }
+    file->map.indirect[index] = num;
+    file->map.dirty = 1;
+    return 1;
+}
+
+int map_alloc_block(FileSystemInternals *fs, FileInternals *file, Inode *inode, int index, BlockRun *run)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (is_extent_inode(inode))
+        return extent_alloc_block(fs, &file->extent_map, inode, index, run);
+    int slot;
+    int offsets[3];
+    int depth = block_path(fs, index, &slot, offsets);
+    if (depth == -1)
+        return -1;
+
+    // the pointer blocks on the path are there down to level top - 1, the cached ones without a look
+    int top = 0;
+    if (depth == 1 && get_direct_block_num(inode, SINGLE_INDIRECT) != 0)
+        top = 1;
+    else if (depth >= 2 && file->map.leaf_block != 0 && file->map.leaf_first == index - offsets[depth - 1])
+        top = depth;
+    else
+    {
+        while (top < depth && path_block_num(fs, inode, slot, offsets, top) != 0)
+        {
+            top++;
+        }
+    }
+
+    // the new pointer blocks are levels top to depth - 1 of the path, then the block itself
+    int pointers[3];
+    int num = -1;
+    int taken = top;
+    while (taken <= depth)
+    {
+        int block_num = take_block(fs, run);
+        if (block_num == -1)
+            break;
+        if (taken < depth)
+            pointers[taken] = block_num;
+        else
+            num = block_num;
+        taken++;
+    }
+    if (num == -1)
+    {
+        for (int k = top; k < taken; k++)
+        {
+            free_block(fs, pointers[k]);
+        }
+        return -1;
+    }
+
+    if (depth == 1 && top == 0)
+    {
+        set_direct_block_num(fs, inode, SINGLE_INDIRECT, pointers[0]);
+        new_block_map(fs, file);
+    }
+    else if (depth >= 2 && top < depth)
+    {
+        // a new inner pointer block only maps the next level down so far. The new blocks
+        // go back when the path to them can't be written
+        uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+        int linked = 1;
+        for (int k = top; k < depth - 1 && linked; k++)
+        {
+            memset(block_data, 0, sizeof(block_data));
+            block_data[offsets[k]] = htole32((uint32_t)pointers[k + 1]);
+            linked = write_cache_block(&fs->cache, block_data, pointers[k]);
+        }
+        if (linked && top == 0)
+            set_direct_block_num(fs, inode, slot, pointers[0]);
+        else if (linked)
+        {
+            int parent = path_block_num(fs, inode, slot, offsets, top - 1);
+            linked = parent != 0 && read_cache_block(&fs->cache, block_data, parent);
+            if (linked)
+            {
+                block_data[offsets[top - 1]] = htole32((uint32_t)pointers[top]);
+                linked = write_cache_block(&fs->cache, block_data, parent);
+            }
+        }
+        if (!linked)
+        {
+            for (int k = top; k < depth; k++)
+            {
+                free_block(fs, pointers[k]);
+            }
+            free_block(fs, num);
+            return -2;
+        }
+
+        // the new leaf starts empty
+        if (!write_leaf(fs, file))
+            return -2;
+        if (file->map.leaf == NULL)
+        {
+            file->map.leaf = malloc(NUM_ADDRESS_PER_BLOCK * sizeof(int));
+            if (file->map.leaf == NULL)
+                return -1;
+        }
+        memset(file->map.leaf, 0, NUM_ADDRESS_PER_BLOCK * sizeof(int));
+        file->map.leaf_block = pointers[depth - 1];
+        file->map.leaf_first = index - offsets[depth - 1];
+        file->map.leaf_dirty = 1;
+    }
+    if (!map_set_block_num(fs, file, inode, index, num))
+        return -1;
+    if (file->map.end >= 0 && index >= file->map.end)
+        file->map.end = index + 1;
+    return num;
+}
+
+int write_block_map(FileSystemInternals *fs, FileInternals *file)
+{
+    if (!write_extent_map(fs, &file->extent_map) || !write_leaf(fs, file))
+        return 0;
+    if (!file->map.dirty)
+        return 1;
+
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    int indirect_block_num = get_direct_block_num(&fs->inodes.list_inodes[file->file_no], SINGLE_INDIRECT);
+    if (indirect_block_num < fs->bitmap.data_start)
+        return 0;
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    for (int i = 0; i < NUM_ADDRESS_PER_BLOCK; i++)
+    {
+        block_data[i] = htole32((uint32_t)file->map.indirect[i]);
+    }
+    int success = write_cache_block(&fs->cache, block_data, indirect_block_num);
+    if (success)
+        file->map.dirty = 0;
+    return success;
+}
+
+int map_block_end(FileSystemInternals *fs, FileInternals *file, Inode *inode)
+{
+    const long NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (is_extent_inode(inode))
+    {
+        if (!file->extent_map.loaded && !load_extent_map(fs, &file->extent_map, inode))
+            return -1;
+        return file->extent_map.num_blocks;
+    }
+    if (file->map.end >= 0)
+        return file->map.end;
+
+    // the last block is below the deepest pointer block there is, otherwise in the last direct
+    // block used. The pointer blocks are searched in the block cache, the cached ones go there first
+    if (!write_block_map(fs, file))
+        return -1;
+    long firsts[4] = {0, NUM_DIRECT_BLOCK, NUM_DIRECT_BLOCK + NUM_ADDRESS_PER_BLOCK,
+                      NUM_DIRECT_BLOCK + NUM_ADDRESS_PER_BLOCK + NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK};
+    long last = -1;
+    for (int depth = 3; depth >= 1 && last == -1; depth--)
+    {
+        int block_num = get_direct_block_num(inode, SINGLE_INDIRECT + depth - 1);
+        if (block_num > 0)
+            last = last_tree_block(fs, block_num, depth, firsts[depth]);
+        if (last == -2)
+            return -1;
+    }
+    for (int i = NUM_DIRECT_BLOCK - 1; i >= 0 && last == -1; i--)
+    {
+        if (get_direct_block_num(inode, i) > 0)
+            last = i;
+    }
+    file->map.end = last + 1;
+    return file->map.end;
+}
+
+long last_tree_block(FileSystemInternals *fs, int block_num, int depth, long first)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    long span = 1;
+    for (int d = 1; d < depth; d++)
+    {
+        span *= NUM_ADDRESS_PER_BLOCK;
+    }
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    if (!read_cache_block(&fs->cache, block_data, block_num))
+        return -2;
+
+    // a pointer block left without blocks by a hole is skipped for the one before it
+    for (int k = NUM_ADDRESS_PER_BLOCK - 1; k >= 0; k--)
+    {
+        int child = (int)le32toh(block_data[k]);
+        if (child == 0)
+            continue;
+        if (depth == 1)
+            return first + k;
+        long last = last_tree_block(fs, child, depth - 1, first + k * span);
+        if (last != -1)
+            return last;
+    }
+    return -1;
+}
+
+int map_truncate(FileSystemInternals *fs, FileInternals *file, Inode *inode, int keep)
+{
+    const long NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    if (is_extent_inode(inode))
+        return extent_truncate(fs, &file->extent_map, inode, keep);
+    int end = map_block_end(fs, file, inode);
+    if (end == -1)
+        return -1;
+    if (keep >= end)
+        return 0;
+
+    // the tree is cut in the block cache, the cached pointer blocks go there first
+    if (!write_block_map(fs, file))
+        return -1;
+    BlockRun freed = {0, 0, 0};
+    int count = 0;
+    int success = 1;
+    for (int i = keep; i < NUM_DIRECT_BLOCK; i++)
+    {
+        int block_num = get_direct_block_num(inode, i);
+        if (block_num > 0)
+        {
+            inode->block_nums[i] = 0;
+            count++;
+            if (!add_to_free_run(fs, &freed, block_num))
+                success = 0;
+        }
+    }
+    long first = NUM_DIRECT_BLOCK;
+    long span = NUM_ADDRESS_PER_BLOCK;
+    for (int depth = 1; depth <= 3; depth++)
+    {
+        int slot = SINGLE_INDIRECT + depth - 1;
+        int block_num = get_direct_block_num(inode, slot);
+        if (block_num > 0 && first + span > keep)
+        {
+            int gone = truncate_pointer_tree(fs, block_num, depth, first, keep, &freed, &count);
+            if (gone == 1)
+                inode->block_nums[slot] = 0;
+            if (gone == -1 || (gone == 1 && !add_to_free_run(fs, &freed, block_num)))
+                success = 0;
+        }
+        first += span;
+        span *= NUM_ADDRESS_PER_BLOCK;
+    }
+    if (!discard_blocks(fs, freed.next, freed.left))
+        success = 0;
+
+    // the cached pointer blocks may be gone, they are loaded again when needed
+    file->map.num_indirect = 0;
+    file->map.leaf_block = 0;
+    file->map.end = keep;
+    return success ? count : -1;
+}
+
+int truncate_pointer_tree(FileSystemInternals *fs, int block_num, int depth, long first, int keep, BlockRun *freed,
+                          int *count)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    long span = 1;
+    for (int d = 1; d < depth; d++)
+    {
+        span *= NUM_ADDRESS_PER_BLOCK;
+    }
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    if (!read_cache_block(&fs->cache, block_data, block_num))
+        return -1;
+
+    // a child from keep on goes whole, the one across keep is cut first and goes when that empties it
+    uint32_t gone_children[NUM_ADDRESS_PER_BLOCK];
+    memcpy(gone_children, block_data, sizeof(block_data));
+    int changed = 0;
+    int used = 0;
+    for (int k = 0; k < NUM_ADDRESS_PER_BLOCK; k++)
+    {
+        int child = (int)le32toh(block_data[k]);
+        if (child == 0)
+            continue;
+        long child_first = first + k * span;
+        int gone = 1;
+        if (child_first + span <= keep)
+            gone = 0;
+        else if (depth > 1 && child_first < keep)
+            gone = truncate_pointer_tree(fs, child, depth - 1, child_first, keep, freed, count);
+        if (gone == -1)
+            return -1;
+        if (gone)
+        {
+            block_data[k] = 0;
+            changed = 1;
+        }
+        else
+        {
+            gone_children[k] = 0;
+            used = 1;
+        }
+    }
+
+    // the children are freed once the block across keep no longer points at them, a block past
+    // keep is already out of its parent
+    if (changed && first < keep && !write_cache_block(&fs->cache, block_data, block_num))
+        return -1;
+    int success = 1;
+    for (int k = 0; k < NUM_ADDRESS_PER_BLOCK; k++)
+    {
+        int child = (int)le32toh(gone_children[k]);
+        if (child == 0)
+            continue;
+        long child_first = first + k * span;
+        if (depth > 1 && child_first >= keep &&
+            truncate_pointer_tree(fs, child, depth - 1, child_first, keep, freed, count) == -1)
+        {
+            success = 0;
+            continue;
+        }
+        if (depth == 1)
+            (*count)++;
+        if (!add_to_free_run(fs, freed, child))
+            success = 0;
+    }
+    if (!success)
+        return -1;
+    return !used;
+}
+
+////////////// EXTENT MAP OPERATIONS DEFINITION //////////////
+
+int load_extent_map(FileSystemInternals *fs, ExtentMap *map, Inode *inode)
+{
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    const int EXTENTS_PER_BLOCK = (fs->disk.block_size - EXTENT_BLOCK_HEADER) / EXTENT_SIZE;
+    map->loaded = 0;
+    map->num_extents = 0;
+    map->num_blocks = 0;
+    map->chain_len = 0;
+    map->dirty_from = 0;
+    map->hint = 0;
+
+    int num_extents = (int)le32toh(inode->num_extents);
+    if (num_extents < 0 || (unsigned long)num_extents > fs->disk.max_blocks || !reserve_extent_map(map, num_extents))
+        return 0;
+
+    // the 1st extents are in the inode, the others in the extent blocks, in order
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    int block_num = (int)le32toh(inode->extent_block);
+    int count = num_extents < NUM_INODE_EXTENTS ? num_extents : NUM_INODE_EXTENTS;
+    Extent *extents = inode->extents;
+    while (1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            FileExtent *extent = &map->extents[map->num_extents++];
+            extent->first = map->num_blocks;
+            extent->start = (int)le32toh(extents[i].start);
+            extent->length = (int)le32toh(extents[i].length);
+            map->num_blocks += extent->length;
+        }
+        if (map->num_extents == num_extents)
+            break;
+
+        if (block_num < fs->bitmap.data_start || block_num > fs->bitmap.max_block ||
+            !read_cache_block(&fs->cache, block_data, block_num))
+            return 0;
+        map->chain[map->chain_len++] = block_num;
+        block_num = (int)le32toh(block_data[0]);
+        count = (int)le32toh(block_data[1]);
+        if (count <= 0 || count > EXTENTS_PER_BLOCK || count > num_extents - map->num_extents)
+            return 0;
+        extents = (Extent *)(block_data + EXTENT_BLOCK_HEADER / NUM_BYTES_PER_ADDRESS);
+    }
+    map->dirty_from = map->chain_len;
+    map->loaded = 1;
+    return 1;
+}
+
+int reserve_extent_map(ExtentMap *map, int count)
+{
+    if (count > map->allocated)
+    {
+        int allocated = 2 * count > 16 ? 2 * count : 16;
+        FileExtent *extents = realloc(map->extents, allocated * sizeof(FileExtent));
+        if (extents == NULL)
+            return 0;
+        map->extents = extents;
+        map->allocated = allocated;
+    }
+    if (count > map->chain_allocated)
+    {
+        int *chain = realloc(map->chain, 2 * count * sizeof(int));
+        if (chain == NULL)
+            return 0;
+        map->chain = chain;
+        map->chain_allocated = 2 * count;
+    }
+    return 1;
+}
+
+int extent_block_num(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int index)
+{
+    if (!map->loaded)
+    {
+        if (!load_extent_map(fs, map, inode))
+            return -1;
+    }
+    if (index < 0)
+        return -1;
+    if (index >= map->num_blocks)
+        return 0;
+
+    // lookups mostly go on from the extent of the last one, otherwise search the extents
+    int e = map->hint < map->num_extents ? map->hint : 0;
+    if (index < map->extents[e].first || index >= map->extents[e].first + map->extents[e].length)
+    {
+        int low = 0;
+        int high = map->num_extents - 1;
+        while (low < high)
+        {
+            int mid = (low + high + 1) / 2;
+            if (map->extents[mid].first <= index)
+                low = mid;
+            else
+                high = mid - 1;
+        }
+        e = low;
+    }
+    map->hint = e;
+    if (map->extents[e].start == 0)
+        return 0;
+    return map->extents[e].start + index - map->extents[e].first;
+}
+
+void merge_extent(FileExtent *list, int *count, FileExtent extent)
+{
+    FileExtent *last = *count > 0 ? &list[*count - 1] : NULL;
+    if (last != NULL && ((last->start == 0 && extent.start == 0) ||
+                         (last->start != 0 && last->start + last->length == extent.start)))
+        last->length += extent.length;
+    else
+        list[(*count)++] = extent;
+}
+
+int splice_extents(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int lo, int hi, FileExtent *repl, int count)
+{
+    const int EXTENTS_PER_BLOCK = (fs->disk.block_size - EXTENT_BLOCK_HEADER) / EXTENT_SIZE;
+    int num_extents = map->num_extents - (hi - lo) + count;
+    int needed = num_extents > NUM_INODE_EXTENTS ? (num_extents - NUM_INODE_EXTENTS + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK : 0;
+    if (!reserve_extent_map(map, num_extents))
+        return 0;
+
+    // take the extent blocks first, they are all that can fail
+    int old_chain_len = map->chain_len;
+    while (map->chain_len < needed)
+    {
+        int block_num = get_free_block(fs);
+        if (block_num == -1)
+        {
+            while (map->chain_len > old_chain_len)
+            {
+                free_block(fs, map->chain[--map->chain_len]);
+            }
+            return 0;
+        }
+        map->chain[map->chain_len++] = block_num;
+    }
+    if (map->chain_len > old_chain_len && map->dirty_from > old_chain_len - 1)
+        map->dirty_from = old_chain_len > 0 ? old_chain_len - 1 : 0;
+    while (map->chain_len > needed)
+    {
+        free_block(fs, map->chain[--map->chain_len]);
+        if (map->dirty_from > map->chain_len - 1)
+            map->dirty_from = map->chain_len > 0 ? map->chain_len - 1 : 0;
+    }
+    inode->extent_block = htole32((uint32_t)(map->chain_len > 0 ? map->chain[0] : 0));
+
+    // the extents from lo on move, their first blocks follow from the lengths
+    memmove(&map->extents[lo + count], &map->extents[hi], (map->num_extents - hi) * sizeof(FileExtent));
+    memcpy(&map->extents[lo], repl, count * sizeof(FileExtent));
+    map->num_extents = num_extents;
+    map->num_blocks = lo > 0 ? map->extents[lo - 1].first + map->extents[lo - 1].length : 0;
+    for (int e = lo; e < num_extents; e++)
+    {
+        map->extents[e].first = map->num_blocks;
+        map->num_blocks += map->extents[e].length;
+    }
+    map->hint = lo;
+
+    // extents in the inode are written with it, the others with the extent blocks
+    inode->num_extents = htole32((uint32_t)num_extents);
+    for (int e = lo; e < num_extents && e < NUM_INODE_EXTENTS; e++)
+    {
+        inode->extents[e].start = htole32((uint32_t)map->extents[e].start);
+        inode->extents[e].length = htole32((uint32_t)map->extents[e].length);
+    }
+    int k = lo > NUM_INODE_EXTENTS ? (lo - NUM_INODE_EXTENTS) / EXTENTS_PER_BLOCK : 0;
+    if (map->dirty_from > k)
+        map->dirty_from = k;
+    return 1;
+}
+
+int extent_alloc_block(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int index, BlockRun *run)
+{
+    if (!map->loaded)
+    {
+        if (!load_extent_map(fs, map, inode))
+            return -1;
+    }
+    int num = take_block(fs, run);
+    if (num == -1)
+        return -1;
+    FileExtent block = {0, num, 1};
+
+    // the block and its neighbours replace extents lo to hi - 1: the last extent and
+    // a hole up to index past the mapped blocks, otherwise the hole extent holding index
+    // and the extents around it
+    FileExtent repl[5];
+    int count = 0;
+    int lo;
+    int hi;
+    int n = map->num_extents;
+    if (index >= map->num_blocks)
+    {
+        lo = n > 0 ? n - 1 : 0;
+        hi = n;
+        if (n > 0)
+            merge_extent(repl, &count, map->extents[n - 1]);
+        if (index > map->num_blocks)
+        {
+            FileExtent hole = {0, 0, index - map->num_blocks};
+            merge_extent(repl, &count, hole);
+        }
+        merge_extent(repl, &count, block);
+    }
+    else
+    {
+        if (extent_block_num(fs, map, inode, index) != 0)
+        {
+            free_block(fs, num);
+            return -1;
+        }
+        int e = map->hint;
+        FileExtent hole = map->extents[e];
+        lo = e > 0 ? e - 1 : e;
+        hi = e + 1 < n ? e + 2 : e + 1;
+        if (e > 0)
+            merge_extent(repl, &count, map->extents[e - 1]);
+        FileExtent left = {0, 0, index - hole.first};
+        FileExtent right = {0, 0, hole.first + hole.length - index - 1};
+        if (left.length > 0)
+            merge_extent(repl, &count, left);
+        merge_extent(repl, &count, block);
+        if (right.length > 0)
+            merge_extent(repl, &count, right);
+        if (e + 1 < n)
+            merge_extent(repl, &count, map->extents[e + 1]);
+    }
+    if (!splice_extents(fs, map, inode, lo, hi, repl, count))
+    {
+        free_block(fs, num);
+        return -1;
+    }
+    return num;
+}
+
+int write_extent_map(FileSystemInternals *fs, ExtentMap *map)
+{
+    if (!map->loaded || map->dirty_from >= map->chain_len)
+        return 1;
+
+    const int NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    const int EXTENTS_PER_BLOCK = (fs->disk.block_size - EXTENT_BLOCK_HEADER) / EXTENT_SIZE;
+    uint32_t block_data[NUM_ADDRESS_PER_BLOCK];
+    for (int k = map->dirty_from; k < map->chain_len; k++)
+    {
+        int first = NUM_INODE_EXTENTS + k * EXTENTS_PER_BLOCK;
+        int count = map->num_extents - first < EXTENTS_PER_BLOCK ? map->num_extents - first : EXTENTS_PER_BLOCK;
+        memset(block_data, 0, sizeof(block_data));
+        block_data[0] = htole32((uint32_t)(k + 1 < map->chain_len ? map->chain[k + 1] : 0));
+        block_data[1] = htole32((uint32_t)count);
+        Extent *extents = (Extent *)(block_data + EXTENT_BLOCK_HEADER / NUM_BYTES_PER_ADDRESS);
+        for (int i = 0; i < count; i++)
+        {
+            extents[i].start = htole32((uint32_t)map->extents[first + i].start);
+            extents[i].length = htole32((uint32_t)map->extents[first + i].length);
+        }
+        if (!write_cache_block(&fs->cache, block_data, map->chain[k]))
+        {
+            map->dirty_from = k;
+            return 0;
+        }
+    }
+    map->dirty_from = map->chain_len;
+    return 1;
+}
+
+int free_extent_blocks(FileSystemInternals *fs, Inode *inode)
+{
+    ExtentMap map;
+    memset(&map, 0, sizeof(ExtentMap));
+    int success = load_extent_map(fs, &map, inode);
+    if (success)
+    {
+        // a whole extent is given back at once
+        for (int e = 0; e < map.num_extents; e++)
+        {
+            if (map.extents[e].start != 0 && !discard_blocks(fs, map.extents[e].start, map.extents[e].length))
+                success = 0;
+        }
+        BlockRun freed = {0, 0, 0};
+        for (int k = 0; k < map.chain_len; k++)
+        {
+            if (!add_to_free_run(fs, &freed, map.chain[k]))
+                success = 0;
+        }
+        if (!discard_blocks(fs, freed.next, freed.left))
+            success = 0;
+    }
+    free(map.extents);
+    free(map.chain);
+    return success;
+}
+
+int extent_truncate(FileSystemInternals *fs, ExtentMap *map, Inode *inode, int keep)
+{
+    if (!map->loaded)
+    {
+        if (!load_extent_map(fs, map, inode))
+            return -1;
+    }
+    if (keep >= map->num_blocks)
+        return 0;
+
+    // extents lo on end past keep, the blocks of each past keep are given back at once
+    int n = map->num_extents;
+    int lo = n - 1;
+    while (lo > 0 && map->extents[lo - 1].first + map->extents[lo - 1].length > keep)
+    {
+        lo--;
+    }
+    int count = 0;
+    int success = 1;
+    for (int e = lo; e < n; e++)
+    {
+        int cut = map->extents[e].first < keep ? keep - map->extents[e].first : 0;
+        if (map->extents[e].start != 0)
+        {
+            if (!discard_blocks(fs, map->extents[e].start + cut, map->extents[e].length - cut))
+                success = 0;
+            count += map->extents[e].length - cut;
+        }
+    }
+
+    // what is left of extent lo stays, unless it is a hole, which can't end the file
+    FileExtent kept = map->extents[lo];
+    kept.length = keep - kept.first;
+    int num_kept = kept.length > 0 && kept.start != 0 ? 1 : 0;
+    if (kept.length == 0 && lo > 0 && map->extents[lo - 1].start == 0)
+        lo--;
+    if (!splice_extents(fs, map, inode, lo, n, &kept, num_kept) || !success)
+        return -1;
+    return count;
+}
+
+////////////// WRITE BUFFER OPERATIONS DEFINITION //////////////
+
+unsigned long buffer_write(FileSystemInternals *fs, FileInternals *file, void *buf, unsigned long numbytes)
+{
+    unsigned long first_pos = file->cur_pos;
+    char *charBuf = (char *)buf;
+
+    // only a write that continues the buffered bytes is gathered
+    if (file->wbuf.len > 0 && file->cur_pos != file->wbuf.start + file->wbuf.len)
+    {
+        if (!flush_write_buffer(fs, file))
+            return 0;
+    }
+    fserror = FS_NONE;
+    unsigned long done = 0;
+    while (done < numbytes)
+    {
+        if (file->wbuf.len == 0)
+        {
+            file->wbuf.start = file->cur_pos;
+            file->wbuf.limit = file->cur_pos / fs->disk.block_size * fs->disk.block_size + file->wbuf.size;
+        }
+        unsigned long chunk = numbytes - done;
+        if (chunk > file->wbuf.limit - file->cur_pos)
+            chunk = file->wbuf.limit - file->cur_pos;
+        memcpy(file->wbuf.data + file->wbuf.len, charBuf + done, chunk);
+        file->wbuf.len += chunk;
+        file->cur_pos += chunk;
+        done += chunk;
+
+        // full up to a block boundary, write it as whole blocks
+        if (file->cur_pos == file->wbuf.limit && !flush_write_buffer(fs, file))
+            return file->cur_pos > first_pos ? file->cur_pos - first_pos : 0;
+    }
+    return done;
+}
+
+int flush_write_buffer(FileSystemInternals *fs, FileInternals *file)
+{
+    if (file->wbuf.len == 0)
+        return 1;
+
+    // a failed write leaves the position after the last byte that made it
+    unsigned long len = file->wbuf.len;
+    file->wbuf.len = 0;
+    FileIOVec seg = {file->wbuf.data, len};
+    unsigned long written = write_through(fs, file, &seg, 1, file->wbuf.start);
+    if (written < len)
+    {
+        file->cur_pos = file->wbuf.start + written;
+        return 0;
+    }
+    return 1;
+}
+
+////////////// READ AHEAD OPERATIONS DEFINITION //////////////
+
+void read_ahead(FileSystemInternals *fs, FileInternals *file, Inode *inode, int start_block, int end_block, unsigned long pos)
+{
+    ReadAhead *ra = &file->ra;
+
+    // prefetched blocks this read uses, each counted once
+    int first_hit = start_block > ra->next_hit ? start_block : ra->next_hit;
+    if (first_hit < ra->start)
+        first_hit = ra->start;
+    int last_hit = end_block < ra->end - 1 ? end_block : ra->end - 1;
+    if (first_hit <= last_hit)
+    {
+        fs->readahead_hits += last_hit - first_hit + 1;
+        ra->next_hit = last_hit + 1;
+    }
+
+    if (pos != ra->next_pos)
+    {
+        memset(ra, 0, sizeof(ReadAhead));
+        return;
+    }
+
+    // prefetch once the read reaches the 2nd half of the prefetched blocks
+    if (ra->window != 0 && end_block < ra->end - ra->window / 2)
+        return;
+    int max_window = fs->cache.capacity / 4 < READAHEAD_MAX_BLOCKS ? fs->cache.capacity / 4 : READAHEAD_MAX_BLOCKS;
+    if (ra->window == 0)
+        ra->window = READAHEAD_MIN_BLOCKS;
+    else if (ra->window < max_window)
+        ra->window = 2 * ra->window < max_window ? 2 * ra->window : max_window;
+
+    int first = end_block + 1 > ra->end ? end_block + 1 : ra->end;
+    int last = first + ra->window - 1;
+    int size_blocks = (get_size_in_inode(inode) + fs->disk.block_size - 1) / fs->disk.block_size;
+    if (last > size_blocks - 1)
+        last = size_blocks - 1;
+    if (first > last)
+        return;
+
+    unsigned long blocknums[last - first + 1];
+    int count = 0;
+    for (int i = first; i <= last; i++)
+    {
+        int block_num = map_block_num(fs, file, inode, i);
+        if (block_num > 0)
+            blocknums[count++] = block_num;
+    }
+    if (count > 0 && !prefetch_cache_blocks(&fs->cache, blocknums, count))
+        return;
+    fs->readahead_blocks += last - first + 1;
+    if (first != ra->end)
+    {
+        ra->start = first;
+        ra->next_hit = first;
+    }
+    ra->end = last + 1;
+}
+
+////////////// BORROW OPERATIONS DEFINITION //////////////
+
+unsigned long borrow_at(FileSystemInternals *fs, FileInternals *file, unsigned long numbytes, FileSpan *spans,
+                        int maxspans, int *numspans, unsigned long pos)
+{
+    *numspans = 0;
+    Inode file_inode;
+    read_inode(fs, &file_inode, file->file_no);
+    unsigned long file_size = get_size_in_inode(&file_inode);
+    fserror = FS_NONE;
+    if (pos >= file_size || numbytes == 0 || maxspans <= 0)
+        return 0;
+    if (numbytes > file_size - pos)
+        numbytes = file_size - pos;
+
+    // as many blocks as there are spans and the block cache can pin, in one transfer
+    int start_block = pos / fs->disk.block_size;
+    int count = (pos + numbytes - 1) / fs->disk.block_size - start_block + 1;
+    int room = fs->cache.capacity / 2 - fs->cache.num_pinned;
+    if (count > maxspans)
+        count = maxspans;
+    if (count > TRANSFER_BLOCKS)
+        count = TRANSFER_BLOCKS;
+    if (count > room)
+        count = room;
+    // nothing is lent while the pin budget is used up, that is not an error
+    if (count <= 0)
+        return 0;
+
+    // the block numbers are kept for release_borrowed()
+    if (file->borrowed.count + count > file->borrowed.allocated)
+    {
+        int allocated = 2 * (file->borrowed.count + count);
+        unsigned long *blocks = realloc(file->borrowed.blocks, allocated * sizeof(unsigned long));
+        if (blocks == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+        file->borrowed.blocks = blocks;
+        file->borrowed.allocated = allocated;
+    }
+    // holes are lent a block of zeros, only the blocks of the file are pinned
+    unsigned long *blocknums = file->borrowed.blocks + file->borrowed.count;
+    unsigned long pinned[count];
+    int num_pinned = 0;
+    for (int i = 0; i < count; i++)
+    {
+        blocknums[i] = map_block_num(fs, file, &file_inode, start_block + i);
+        if (blocknums[i] != 0)
+            pinned[num_pinned++] = blocknums[i];
+    }
+    if (num_pinned < count && fs->zero_block == NULL)
+        fs->zero_block = calloc(1, fs->disk.block_size);
+    char *pinned_data[count];
+    if ((num_pinned < count && fs->zero_block == NULL) ||
+        (num_pinned > 0 && !pin_cache_blocks(&fs->cache, pinned, num_pinned, pinned_data)))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    // a hole is lent the shared zero block, a write to it later gets a block of its own
+    char *data[count];
+    for (int i = 0, k = 0; i < count; i++)
+    {
+        data[i] = blocknums[i] != 0 ? pinned_data[k++] : fs->zero_block;
+    }
+    file->borrowed.count += count;
+
+    unsigned long numbytes_read = 0;
+    for (int i = 0; i < count; i++)
+    {
+        unsigned long from = i == 0 ? pos % fs->disk.block_size : 0;
+        unsigned long len = fs->disk.block_size - from;
+        if (len > numbytes - numbytes_read)
+            len = numbytes - numbytes_read;
+        spans[i].data = data[i] + from;
+        spans[i].len = len;
+        numbytes_read += len;
+    }
+    *numspans = count;
+    read_ahead(fs, file, &file_inode, start_block, start_block + count - 1, pos);
+    file->ra.next_pos = pos + numbytes_read;
+    return numbytes_read;
+}
+
+void release_borrowed(FileSystemInternals *fs, FileInternals *file)
+{
+    for (int i = 0; i < file->borrowed.count; i++)
+    {
+        if (file->borrowed.blocks[i] != 0)
+            unpin_cache_block(&fs->cache, file->borrowed.blocks[i]);
+    }
+    file->borrowed.count = 0;
+}
+
+////////////// WRITE BACK OPERATIONS DEFINITION //////////////
+
+void start_metadata_timer(FileSystemInternals *fs)
+{
+    if (!fs->metadata_dirty)
+    {
+        fs->metadata_dirty = 1;
+        clock_gettime(CLOCK_MONOTONIC, &fs->metadata_since);
+    }
+}
+
+int write_metadata(FileSystemInternals *fs)
+{
+    int success = write_inodes_to_disk(fs) && write_dir_to_disk(fs) && write_bitmap_to_disk(fs);
+    if (success)
+        fs->metadata_dirty = 0;
+    return success;
+}
+
+int write_back_fs(FileSystemInternals *fs)
+{
+    int success = 1;
+    for (HandleChunk *chunk = fs->handle_chunks; chunk != NULL; chunk = chunk->next)
+    {
+        for (int i = 0; i < HANDLE_CHUNK; i++)
+        {
+            FileInternals *file = &chunk->handles[i];
+            if (!file->is_open)
+                continue;
+            if (!flush_write_buffer(fs, file))
+                success = 0;
+            if (!write_block_map(fs, file))
+                success = 0;
+        }
+    }
+    if (!write_metadata(fs))
+        success = 0;
+    return flush_cache(&fs->cache) && success;
+}
+
+void write_back_if_due(FileSystemInternals *fs)
+{
+    if (!fs->metadata_dirty)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long usecs = (now.tv_sec - fs->metadata_since.tv_sec) * 1000000L + (now.tv_nsec - fs->metadata_since.tv_nsec) / 1000;
+    if (usecs >= METADATA_WRITEBACK_USECS)
+        write_back_fs(fs);
+}
+
+//////////////////////////////// MAIN INTERFACE ////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// init disk specs from the geometry of the software disk
+int init_specs(FileSystemInternals *fs)
+{
+    int success = 1;
+    fs->disk.block_size = sd_block_size(fs->sd);
+    fs->disk.num_blocks = sd_size(fs->sd);
+    if (fs->disk.block_size == 0 || fs->disk.num_blocks == 0)
+    {
+        // no usable disk: keep the layout computable, every block access fails
+        fs->disk.block_size = SOFTWARE_DISK_BLOCK_SIZE;
+        fs->disk.num_blocks = 0;
+        success = 0;
+    }
+
+    // what the direct, single, double and triple indirect blocks address, but no more
+    // than the disk holds
+    const unsigned long NUM_ADDRESS_PER_BLOCK = fs->disk.block_size / NUM_BYTES_PER_ADDRESS;
+    unsigned long max_blocks = NUM_DIRECT_BLOCK + NUM_ADDRESS_PER_BLOCK + NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK +
+                               NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK * NUM_ADDRESS_PER_BLOCK;
+    if (max_blocks > (unsigned long)fs->disk.num_blocks)
+        max_blocks = fs->disk.num_blocks;
+    fs->disk.max_blocks = max_blocks;
+    fs->disk.max_file_size = fs->disk.max_blocks * fs->disk.block_size;
+    return success;
+}
+
+// init the layout: superblock, dir, inodes, bitmap, then the data blocks
+int init_layout(FileSystemInternals *fs)
+{
+    fs->dir.start_block = SUPERBLOCK + 1;                                                                                 // 1
+    fs->dir.num_entries_per_block = fs->disk.block_size / ENTRY_SIZE;                                                     // 8
+    fs->dir.num_blocks_for_Dir = (NUM_FILES + fs->dir.num_entries_per_block - 1) / fs->dir.num_entries_per_block;         // 100
+    fs->inodes.start_block = fs->dir.start_block + fs->dir.num_blocks_for_Dir;                                            // 101
+    fs->inodes.num_inodes_per_block = fs->disk.block_size / INODE_SIZE;                                                   // 4
+    fs->inodes.num_blocks_for_inodes = (NUM_FILES + fs->inodes.num_inodes_per_block - 1) / fs->inodes.num_inodes_per_block; // 200
+    fs->bitmap.start_block = fs->inodes.start_block + fs->inodes.num_blocks_for_inodes;                                   // 301
+    fs->bitmap.max_block = fs->disk.num_blocks - 1;
+    int num_blocks = fs->disk.num_blocks - fs->bitmap.start_block - 1;
+    if (num_blocks < 0)
+        num_blocks = 0;
+    fs->bitmap.size = (num_blocks % 8) == 0 ? num_blocks / 8 : num_blocks / 8 + 1;
+    fs->bitmap.blocks_for_map = (fs->bitmap.size % fs->disk.block_size) == 0 ? fs->bitmap.size / fs->disk.block_size : fs->bitmap.size / fs->disk.block_size + 1;
+    fs->bitmap.data_start = fs->bitmap.start_block + fs->bitmap.blocks_for_map; // 303
+    if (fs->bitmap.data_start >= fs->disk.num_blocks)
+        return 0;
+    // allocate bitmap.words
+    fs->bitmap.num_bits = fs->bitmap.max_block - fs->bitmap.data_start + 1;
+    fs->bitmap.num_words = (fs->bitmap.num_bits + 63) / 64;
+    free(fs->bitmap.words);
+    free(fs->bitmap.dirty);
+    fs->bitmap.words = calloc(fs->bitmap.num_words, sizeof(uint64_t));
+    fs->bitmap.dirty = calloc(fs->bitmap.blocks_for_map, 1);
+    return fs->bitmap.words != NULL && fs->bitmap.dirty != NULL;
+}
+
+// write the cached blocks of the default filesystem back when the program exits
+void flush_at_exit()
+{
+    if (is_init)
+        write_back_fs(&default_fs);
+}
+
+// init block cache
+int init_block_cache(FileSystemInternals *fs)
+{
+    BCPolicy policy = fs->cache_policy == CACHE_CLOCK ? BC_CLOCK : BC_LRU;
+    return init_cache(&fs->cache, fs->sd, fs->cache_budget, policy, fs->disk.block_size);
+}
+
+// init fs on software disk sd, return 1 when every part could be loaded, 0 otherwise
+int init_fs(FileSystemInternals *fs, SoftwareDisk sd)
+{
+    int success = 0;
+    int all_success = 1;
+    fs->sd = sd;
+
+    // init disk specs
+    success = init_specs(fs);
+    if (!success)
+        printf("Something wrong with disk specs init!\n");
+    all_success = all_success && success;
+
+    // init block cache
+    success = init_block_cache(fs);
+    if (!success)
+        printf("Something wrong with block cache init!\n");
+    all_success = all_success && success;
+
+    // init layout
+    success = init_layout(fs);
+    if (!success)
+        printf("Something wrong with layout init!\n");
+    all_success = all_success && success;
+
+    // check the on disk format, migrate an ASCII disk
+    if (success)
+    {
+        success = init_format(fs);
+        if (!success)
+            printf("Something wrong with format init!\n");
+        all_success = all_success && success;
+    }
+
+    // init dir
+    success = init_dir(fs);
+    if (!success)
+        printf("Something wrong with dir init!\n");
+    all_success = all_success && success;
+
+    // init inodes
+    success = init_inodes(fs);
+    if (!success)
+        printf("Something wrong with inodes init!\n");
+    all_success = all_success && success;
+
+    // init inodes
+    success = init_bitmap(fs);
+    if (!success)
+        printf("Something wrong with bitmap init!\n");
+    all_success = all_success && success;
+    fserror = FS_NONE;
+    return all_success;
+}
+
+// return the filesystem behind the API without a handle, mounted on first use
+FileSystemInternals *get_default_fs()
+{
+    if (!is_init)
     {
         is_init = 1;
-        init_fs();
+        atexit(flush_at_exit);
+        init_fs(&default_fs, default_software_disk());
+    }
+    return &default_fs;
+}
+
+FileSystem fs_mount(SoftwareDisk sd)
+{
+    FileSystemInternals *fs = calloc(1, sizeof(FileSystemInternals));
+    if (fs == NULL)
+    {
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    fs->cache_budget = DEFAULT_CACHE_BUDGET;
+    fs->cache_policy = CACHE_LRU;
+    fs->block_mapping = MAPPING_BLOCKS;
+    fs->scrub_policy = SCRUB_LAZY;
+    if (!init_fs(fs, sd))
+    {
+        free_cache(&fs->cache);
+        free(fs->bitmap.words);
+        free(fs->bitmap.dirty);
+        free_handles(fs);
+        free(fs);
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    return fs;
+}
+
+int fs_unmount(FileSystem fs)
+{
+    if (fs == NULL)
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        if (is_opened(fs, i))
+        {
+            fserror = FS_FILE_OPEN;
+            return 0;
+        }
+    }
+    int success = write_back_fs(fs);
+    free_cache(&fs->cache);
+    free(fs->bitmap.words);
+    free(fs->bitmap.dirty);
+    free_handles(fs);
+    free(fs->zero_block);
+    free(fs);
+    fserror = success ? FS_NONE : FS_IO_ERROR;
+    return success;
+}
+
+File fs_open_file(FileSystem fs, char *name, FileMode mode)
+{
+    int f_no = get_entry(fs, name);
+    if (f_no == -1)
+    {
+        fserror = FS_FILE_NOT_FOUND;
+        return NULL;
+    }
+    else
+    {
+        File opened_file = alloc_handle(fs);
+        if (opened_file == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return NULL;
+        }
+        if (!add_to_opened_files(fs, f_no, mode))
+        {
+            release_handle(fs, opened_file);
+            fserror = FS_FILE_OPEN;
+            return NULL;
+        }
+        else
+        {
+            fserror = FS_NONE;
+            opened_file->file_no = f_no;
+            opened_file->cur_pos = 0;
+            opened_file->mode = mode;
+            return opened_file;
+        }
+    }
+}
+
+File fs_create_file(FileSystem fs, char *name)
+{
+    // check filename already exsit
+    int ret = get_entry(fs, name);
+    if (ret != -1)
+    {
+        fserror = FS_FILE_ALREADY_EXISTS;
+        return NULL;
+    }
+    FileInternals *created_file = alloc_handle(fs);
+    if (created_file == NULL)
+    {
+        fserror = FS_IO_ERROR;
+        return NULL;
+    }
+    int f_no = add_entry(fs, name);
+    if (f_no != -1)
+    {
+        fserror = FS_NONE;
+        created_file->file_no = f_no;
+        add_to_opened_files(fs, f_no, READ_WRITE);
+        created_file->cur_pos = 0;
+        created_file->mode = READ_WRITE;
+        write_back_if_due(fs);
+        return created_file;
+    }
+    release_handle(fs, created_file);
+    return NULL;
+}
+
+void close_file(File file)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (file->is_open)
+        {
+            // an error of buffered writes, such as FS_OUT_OF_SPACE, is reported here
+            int flushed = flush_write_buffer(fs, file);
+            FSError flush_error = fserror;
+            int success = write_block_map(fs, file) && write_metadata(fs);
+            release_borrowed(fs, file);
+            delete_from_opened_files(fs, file->file_no, file->mode);
+            release_handle(fs, file);
+            if (!flushed)
+                fserror = flush_error;
+            else
+                fserror = success ? FS_NONE : FS_IO_ERROR;
+        }
+        else
+            fserror = FS_FILE_NOT_OPEN;
+    }
+    else
+        fserror = FS_IO_ERROR;
+}
+
+unsigned long segments_length(FileIOVec *iov, int iovcnt)
+{
+    unsigned long length = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        length += iov[i].len;
+    }
+    return length;
+}
+
+char *segment_span(SegmentCursor *cur, unsigned long len)
+{
+    while (cur->seg < cur->iovcnt && cur->off == cur->iov[cur->seg].len)
+    {
+        cur->seg++;
+        cur->off = 0;
+    }
+    if (cur->seg == cur->iovcnt || cur->iov[cur->seg].len - cur->off < len)
+        return NULL;
+    return (char *)cur->iov[cur->seg].buf + cur->off;
+}
+
+void segment_copy(SegmentCursor *cur, char *data, unsigned long len, int to_segments)
+{
+    while (len > 0 && cur->seg < cur->iovcnt)
+    {
+        FileIOVec *seg = &cur->iov[cur->seg];
+        unsigned long chunk = seg->len - cur->off < len ? seg->len - cur->off : len;
+        if (data != NULL)
+        {
+            if (to_segments)
+                memcpy((char *)seg->buf + cur->off, data, chunk);
+            else
+                memcpy(data, (char *)seg->buf + cur->off, chunk);
+            data += chunk;
+        }
+        cur->off += chunk;
+        len -= chunk;
+        if (cur->off == seg->len)
+        {
+            cur->seg++;
+            cur->off = 0;
+        }
+    }
+}
+
+char *stage_blocks(FileSystemInternals *fs, SegmentCursor *cur, unsigned long first, unsigned long numbytes,
+                   int count, SDBlockIO *ios, int *lens, char *staged, char *local)
+{
+    SegmentCursor at = *cur;
+    unsigned long left = numbytes;
+    int num_staged = 0;
+    for (int i = 0; i < count; i++)
+    {
+        unsigned long from = i == 0 ? first : 0;
+        lens[i] = fs->disk.block_size - from < left ? fs->disk.block_size - from : left;
+        left -= lens[i];
+        ios[i].buf = lens[i] == fs->disk.block_size ? segment_span(&at, lens[i]) : NULL;
+        staged[i] = ios[i].buf == NULL;
+        num_staged += staged[i];
+        segment_copy(&at, NULL, lens[i], 0);
+    }
+
+    char *staging = num_staged <= 2 ? local : malloc((size_t)num_staged * fs->disk.block_size);
+    if (staging == NULL)
+        return NULL;
+    for (int i = 0, k = 0; i < count; i++)
+    {
+        if (staged[i])
+            ios[i].buf = staging + (size_t)k++ * fs->disk.block_size;
+    }
+    return staging;
+}
+
+void copy_staged(SegmentCursor *cur, unsigned long first, int count, SDBlockIO *ios, int *lens, char *staged,
+                 int to_segments)
+{
+    for (int i = 0; i < count; i++)
+    {
+        unsigned long from = i == 0 ? first : 0;
+        segment_copy(cur, staged[i] ? (char *)ios[i].buf + from : NULL, lens[i], to_segments);
+    }
+}
+
+unsigned long read_at(FileSystemInternals *fs, FileInternals *file, FileIOVec *iov, int iovcnt, unsigned long pos)
+{
+    unsigned long numbytes = segments_length(iov, iovcnt);
+
+    // get the inode
+    Inode file_inode;
+    int success = read_inode(fs, &file_inode, file->file_no);
+    if (!success)
+        printf("invalid file number!\n");
+
+    // get file_size from inode
+    unsigned long file_size = get_size_in_inode(&file_inode);
+
+    // numbytes to be read
+    unsigned long numbytes_read = 0;
+    if ((pos + numbytes) <= file_size)
+    {
+        numbytes_read = numbytes;
+    }
+    else if (pos < file_size)
+    {
+        numbytes_read = file_size - pos;
+    }
+    fserror = FS_NONE;
+    if (numbytes_read == 0)
+        return 0;
+
+    // start_block index
+    int start_block = pos / fs->disk.block_size;
+    // end_block index
+    int end_block = (pos + numbytes_read - 1) / fs->disk.block_size;
+
+    // blocks read whole into one segment go straight into it, the others through
+    // a staging buffer, in vectored reads of up to TRANSFER_BLOCKS blocks
+    SegmentCursor cur = {iov, iovcnt, 0, 0};
+    char local[2 * fs->disk.block_size];
+    unsigned long done = 0;
+    for (int chunk_start = start_block; chunk_start <= end_block; chunk_start += TRANSFER_BLOCKS)
+    {
+        int count = end_block - chunk_start + 1 < TRANSFER_BLOCKS ? end_block - chunk_start + 1 : TRANSFER_BLOCKS;
+        int first = chunk_start == start_block ? pos % fs->disk.block_size : 0;
+        unsigned long chunk_bytes = count * fs->disk.block_size - first;
+        if (chunk_bytes > numbytes_read - done)
+            chunk_bytes = numbytes_read - done;
+
+        SDBlockIO ios[count];
+        int lens[count];
+        char staged[count];
+        char *staging = stage_blocks(fs, &cur, first, chunk_bytes, count, ios, lens, staged, local);
+        if (staging == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            break;
+        }
+        // holes read as zeros, without a disk read. A chunk that can't be read all
+        // counts for nothing
+        SDBlockIO reads[count];
+        int num_reads = 0;
+        int success = 1;
+        for (int i = 0; i < count && success; i++)
+        {
+            int block_num = map_block_num(fs, file, &file_inode, chunk_start + i);
+            success = block_num != -1;
+            ios[i].blocknum = block_num;
+            if (block_num == 0)
+                memset(ios[i].buf, 0, fs->disk.block_size);
+            else if (success)
+                reads[num_reads++] = ios[i];
+        }
+        if (success && num_reads == 1)
+            success = read_cache_block(&fs->cache, reads[0].buf, reads[0].blocknum);
+        else if (success && num_reads > 1)
+            success = read_cache_blocks(&fs->cache, reads, num_reads);
+        if (success)
+            copy_staged(&cur, first, count, ios, lens, staged, 1);
+        if (staging != local)
+            free(staging);
+        if (!success)
+        {
+            fserror = FS_IO_ERROR;
+            break;
+        }
+        done += chunk_bytes;
+    }
+    numbytes_read = done;
+
+    read_ahead(fs, file, &file_inode, start_block, end_block, pos);
+    file->ra.next_pos = pos + numbytes_read;
+    return numbytes_read;
+}
+
+unsigned long read_file(File file, void *buf, unsigned long numbytes)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (file->is_open)
+        {
+            // buffered writes first, they may be what is read
+            if (!flush_write_buffer(fs, file))
+                return 0;
+
+            FileIOVec seg = {buf, numbytes};
+            unsigned long numbytes_read = read_at(fs, file, &seg, 1, file->cur_pos);
+            file->cur_pos = file->cur_pos + numbytes_read;
+            return numbytes_read;
+        }
+        else
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
+    }
+    else
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
     }
-    if (file != NULL)
+}
+
+unsigned long write_through(FileSystemInternals *fs, FileInternals *file, FileIOVec *iov, int iovcnt, unsigned long pos)
+{
+    unsigned long numbytes = segments_length(iov, iovcnt);
+
+    // get file inode
+    Inode file_inode;
+    read_inode(fs, &file_inode, file->file_no);
+
+    // File specs
+    unsigned long file_size = get_size_in_inode(&file_inode);
+
+    // numbytes to be written
+    unsigned long numbytes_written = 0;
+    if ((pos + numbytes) < fs->disk.max_file_size)
     {
-        if (is_opened(file->file_no))
-        {
-            if (file->mode == READ_WRITE)
-            {
-                // get file inode
-                char file_inode[INODE_SIZE];
-                read_inode(file_inode, file->file_no);
+        fserror = FS_NONE;
+        numbytes_written = numbytes;
+    }
+    else
+    {
+        fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+        if (pos + 1 < fs->disk.max_file_size)
+            numbytes_written = fs->disk.max_file_size - pos - 1;
+    }
+    if (numbytes_written == 0)
+        return 0;
 
-                // File specs
-                int file_size = get_size_in_inode(file_inode);
-                int eof_pos = file_size > 0 ? (file_size - 1) : 0;
+    int start_block = pos / fs->disk.block_size;
+    int end_block = (pos + numbytes_written - 1) / fs->disk.block_size;
 
-                // numbytes to be written
-                int numbytes_written = 0;
-                if ((file->cur_pos + numbytes) < MAX_FILE_SIZE)
-                {
-                    fserror = FS_NONE;
-                    numbytes_written = numbytes;
-                }
-                else
-                {
-                    fserror = FS_EXCEEDS_MAX_FILE_SIZE;
-                    numbytes_written = MAX_FILE_SIZE - file->cur_pos - 1;
-                }
+    // current number of blocks for file, the ones past its last byte preallocated
+    int cur_num_blocks = get_blocks_in_inode(&file_inode);
+    int size_blocks = (file_size + fs->disk.block_size - 1) / fs->disk.block_size;
+    int block_end = map_block_end(fs, file, &file_inode);
+    if (block_end == -1)
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+
+    // preallocated blocks the write skips over read as zeros
+    if (start_block > size_blocks && !zero_blocks(fs, file, &file_inode, size_blocks, start_block - 1))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+
+    // blocks to allocate for the holes the write fills, the part past the end
+    // of file included, and the indirect blocks on the way, asked for as one run
+    BlockRun run = {0, 0, 0};
+    for (int i = start_block; i <= end_block; i++)
+    {
+        if (i >= block_end || map_block_num(fs, file, &file_inode, i) == 0)
+            run.wanted += 1 + new_pointer_blocks(fs, &file_inode, i);
+    }
 
-                int NEEDED_BLOCKS = 0;
-                int remain_bytes = SOFTWARE_DISK_BLOCK_SIZE - eof_pos % SOFTWARE_DISK_BLOCK_SIZE;
-                // number of blocks needed for write
-                if (file_size > 0)
+    // blocks overwritten whole from one segment are written straight from it, the
+    // others through a staging buffer, in vectored writes of up to TRANSFER_BLOCKS blocks
+    SegmentCursor cur = {iov, iovcnt, 0, 0};
+    char local[2 * fs->disk.block_size];
+    unsigned long done = 0;
+    for (int chunk_start = start_block; chunk_start <= end_block; chunk_start += TRANSFER_BLOCKS)
+    {
+        int count = end_block - chunk_start + 1 < TRANSFER_BLOCKS ? end_block - chunk_start + 1 : TRANSFER_BLOCKS;
+
+        // read block numbers from the map, allocate new free blocks for the holes. The
+        // blocks past the end of file hold nothing yet, like new ones
+        SDBlockIO ios[count];
+        int indexes[count];
+        char fresh[count];
+        int num_blocks = 0;
+        for (int i = chunk_start; i < chunk_start + count; i++)
+        {
+            int block_num = i < block_end ? map_block_num(fs, file, &file_inode, i) : 0;
+            fresh[num_blocks] = block_num == 0 || i >= size_blocks;
+            if (block_num == 0)
+            {
+                block_num = map_alloc_block(fs, file, &file_inode, i, &run);
+                if (block_num < 0)
                 {
-                    if (numbytes_written <= remain_bytes)
-                        NEEDED_BLOCKS = 1;
-                    else
-                        NEEDED_BLOCKS = (numbytes_written - remain_bytes) / SOFTWARE_DISK_BLOCK_SIZE + 1;
+                    fserror = block_num == -1 ? FS_OUT_OF_SPACE : FS_IO_ERROR;
+                    break;
                 }
-                else
-                    NEEDED_BLOCKS = (numbytes_written - 1) / SOFTWARE_DISK_BLOCK_SIZE + 1;
+                cur_num_blocks++;
+            }
+            else if (block_num == -1)
+            {
+                fserror = FS_IO_ERROR;
+                break;
+            }
+            indexes[num_blocks++] = block_num;
+        }
+        if (num_blocks == 0)
+            break;
+
+        int first = chunk_start == start_block ? pos % fs->disk.block_size : 0;
+        unsigned long chunk_bytes = num_blocks * fs->disk.block_size - first;
+        if (chunk_bytes > numbytes_written - done)
+            chunk_bytes = numbytes_written - done;
+        int lens[num_blocks];
+        char staged[num_blocks];
+        char *staging = stage_blocks(fs, &cur, first, chunk_bytes, num_blocks, ios, lens, staged, local);
+        if (staging == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            break;
+        }
+
+        // load the partially overwritten blocks, only the 1st and last can be, a new one starts zeroed
+        SDBlockIO partial[2];
+        int num_partial = 0;
+        for (int i = 0; i < num_blocks; i++)
+        {
+            ios[i].blocknum = indexes[i];
+            if (lens[i] < fs->disk.block_size && fresh[i])
+                memset(ios[i].buf, 0, fs->disk.block_size);
+            else if (lens[i] < fs->disk.block_size)
+                partial[num_partial++] = ios[i];
+        }
+        int success = 1;
+        if (num_partial == 1)
+            success = read_cache_block(&fs->cache, partial[0].buf, partial[0].blocknum);
+        else if (num_partial > 1)
+            success = read_cache_blocks(&fs->cache, partial, num_partial);
+
+        // a chunk that can't be written counts for nothing, the file doesn't grow over it
+        if (success)
+        {
+            copy_staged(&cur, first, num_blocks, ios, lens, staged, 0);
+            if (num_blocks == 1)
+                success = write_cache_block(&fs->cache, ios[0].buf, ios[0].blocknum);
+            else
+                success = write_cache_blocks(&fs->cache, ios, num_blocks);
+        }
+        if (staging != local)
+            free(staging);
+        if (!success)
+        {
+            fserror = FS_IO_ERROR;
+            break;
+        }
+        done += chunk_bytes;
+        if (num_blocks < count)
+            break;
+    }
+    release_run(fs, &run);
+    set_blocks_in_inode(fs, &file_inode, cur_num_blocks);
+    numbytes_written = done;
 
-                // array of block numbers for write_file
-                int indexes[NEEDED_BLOCKS];
+    // update file_size, a write that failed from its 1st chunk on leaves it as it was
+    unsigned long new_file_size = pos + numbytes_written;
+    if (numbytes_written > 0 && new_file_size > file_size)
+        file_size = new_file_size;
+    set_size_in_inode(fs, &file_inode, file_size);
+    write_inode(fs, &file_inode, file->file_no);
 
-                int start_block = file->cur_pos / SOFTWARE_DISK_BLOCK_SIZE;
-                int end_block = start_block + NEEDED_BLOCKS - 1;
-                int eof_block = file_size > 0 ? (file_size - 1) / SOFTWARE_DISK_BLOCK_SIZE : 0;
+    // the inode and bitmap go to disk on close, sync or when due
+    mark_inode_dirty(fs, file->file_no);
 
-                // current number of blocks for file
-                int cur_num_blocks = get_blocks_in_inode(file_inode);
+    return numbytes_written;
+}
 
-                // read block number from inode into indexes, may need to allocate new free block
-                // handle empty file
-                if (cur_num_blocks == 0)
-                {
-                    for (int i = start_block; i <= end_block; i++)
-                    {
-                        int new_block_num = get_free_block();
-                        if (new_block_num == -1)
-                        {
-                            fserror = FS_OUT_OF_SPACE;
-                            break;
-                        }
-                        if (i == 12)
-                        {
-                            set_direct_block_num(file_inode, i, new_block_num);
-                            // get another block in put into indirect block
-                            new_block_num = get_free_block();
-                            if (new_block_num == -1)
-                            {
-                                fserror = FS_OUT_OF_SPACE;
-                                break;
-                            }
-                        }
-                        set_block_num(file_inode, i, new_block_num);
-                        cur_num_blocks++;
-                        indexes[i - start_block] = new_block_num;
-                    }
-                    set_blocks_in_inode(file_inode, cur_num_blocks);
-                }
-                // handle case when start in the middle of the file and write not exceed current file size
-                else if (end_block <= eof_block)
+int zero_blocks(FileSystemInternals *fs, FileInternals *file, Inode *inode, int first, int last)
+{
+    int block_end = map_block_end(fs, file, inode);
+    if (block_end == -1)
+        return 0;
+    if (last > block_end - 1)
+        last = block_end - 1;
+    if (first > last)
+        return 1;
+
+    char empty_data[fs->disk.block_size];
+    memset(empty_data, 0, fs->disk.block_size);
+    for (int i = first; i <= last; i++)
+    {
+        int block_num = map_block_num(fs, file, inode, i);
+        if (block_num == -1 || (block_num > 0 && !write_cache_block(&fs->cache, empty_data, block_num)))
+            return 0;
+    }
+    return 1;
+}
+
+int truncate_at(FileSystemInternals *fs, FileInternals *file, unsigned long len)
+{
+    Inode file_inode;
+    read_inode(fs, &file_inode, file->file_no);
+    unsigned long file_size = get_size_in_inode(&file_inode);
+    int size_blocks = (file_size + fs->disk.block_size - 1) / fs->disk.block_size;
+    int keep = (len + fs->disk.block_size - 1) / fs->disk.block_size;
+    int tail = len % fs->disk.block_size;
+
+    // the bytes cut from the last block kept read as zeros when the file grows again,
+    // so do the preallocated blocks it grows over
+    if (len < file_size && tail > 0)
+    {
+        int block_num = map_block_num(fs, file, &file_inode, keep - 1);
+        char data[fs->disk.block_size];
+        if (block_num == -1 || (block_num > 0 && !read_cache_block(&fs->cache, data, block_num)))
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+        memset(data + tail, 0, fs->disk.block_size - tail);
+        if (block_num > 0 && !write_cache_block(&fs->cache, data, block_num))
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+    else if (len > file_size && !zero_blocks(fs, file, &file_inode, size_blocks, keep - 1))
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+
+    // the blocks past len are given back a run at a time
+    int freed = map_truncate(fs, file, &file_inode, keep);
+    if (freed == -1)
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    set_blocks_in_inode(fs, &file_inode, get_blocks_in_inode(&file_inode) - freed);
+    set_size_in_inode(fs, &file_inode, len);
+    write_inode(fs, &file_inode, file->file_no);
+    mark_inode_dirty(fs, file->file_no);
+    fserror = FS_NONE;
+    return 1;
+}
+
+int preallocate_at(FileSystemInternals *fs, FileInternals *file, unsigned long len)
+{
+    Inode file_inode;
+    read_inode(fs, &file_inode, file->file_no);
+    int size_blocks = (get_size_in_inode(&file_inode) + fs->disk.block_size - 1) / fs->disk.block_size;
+    int last = (len + fs->disk.block_size - 1) / fs->disk.block_size - 1;
+    int cur_num_blocks = get_blocks_in_inode(&file_inode);
+
+    // the holes and the pointer blocks on the way are asked for as one run, so they get
+    // consecutive blocks when the disk has them
+    BlockRun run = {0, 0, 0};
+    for (int i = 0; i <= last; i++)
+    {
+        int block_num = map_block_num(fs, file, &file_inode, i);
+        if (block_num == -1)
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+        if (block_num == 0)
+            run.wanted += 1 + new_pointer_blocks(fs, &file_inode, i);
+    }
+
+    // a hole before the end of file reads as zeros with its block too. The blocks past it
+    // are written before they are read, but with SCRUB_LAZY what they held is cleared now
+    char empty_data[fs->disk.block_size];
+    memset(empty_data, 0, fs->disk.block_size);
+    fserror = FS_NONE;
+    for (int i = 0; i <= last; i++)
+    {
+        int block_num = map_block_num(fs, file, &file_inode, i);
+        if (block_num != 0)
+            continue;
+        block_num = map_alloc_block(fs, file, &file_inode, i, &run);
+        if (block_num < 0)
+        {
+            fserror = block_num == -1 ? FS_OUT_OF_SPACE : FS_IO_ERROR;
+            break;
+        }
+        cur_num_blocks++;
+        if ((i < size_blocks || fs->scrub_policy == SCRUB_LAZY) &&
+            !write_cache_block(&fs->cache, empty_data, block_num))
+        {
+            fserror = FS_IO_ERROR;
+            break;
+        }
+    }
+    release_run(fs, &run);
+    set_blocks_in_inode(fs, &file_inode, cur_num_blocks);
+    write_inode(fs, &file_inode, file->file_no);
+    mark_inode_dirty(fs, file->file_no);
+    return fserror == FS_NONE;
+}
+
+unsigned long write_file(File file, void *buf, unsigned long numbytes)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (file->is_open)
+        {
+            if (file->mode == READ_WRITE)
+            {
+                unsigned long numbytes_written = 0;
+                if (file->wbuf.size > 0 && numbytes < file->wbuf.size && file->cur_pos + numbytes < fs->disk.max_file_size)
+                    numbytes_written = buffer_write(fs, file, buf, numbytes);
+                else if (flush_write_buffer(fs, file))
                 {
-                    for (int i = start_block; i <= end_block; i++)
-                    {
-                        indexes[i - start_block] = get_block_num(file_inode, i);
-                    }
+                    FileIOVec seg = {buf, numbytes};
+                    numbytes_written = write_through(fs, file, &seg, 1, file->cur_pos);
+                    file->cur_pos = file->cur_pos + numbytes_written;
                 }
-                // handle case when write exceed current file size
-                else
+                write_back_if_due(fs);
+                return numbytes_written;
+            }
+            else
+            {
+                fserror = FS_FILE_READ_ONLY;
+                return 0;
+            }
+        }
+        else
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
+    }
+    else
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+}
+
+int seek_file(File file, unsigned long bytepos)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (!file->is_open)
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
+        if (!flush_write_buffer(fs, file))
+            return 0;
+        if (bytepos < fs->disk.max_file_size)
+        { // get file_inode
+            Inode file_inode;
+            if (!read_inode(fs, &file_inode, file->file_no))
+            {
+                fserror = FS_IO_ERROR;
+                return 0;
+            }
+
+            // a seek past the end of file extends it with a hole, its blocks
+            // are allocated when they are written
+            unsigned long file_size = get_size_in_inode(&file_inode);
+            if (bytepos >= file_size)
+            {
+                // except the preallocated ones, which only need to read as zeros
+                int size_blocks = (file_size + fs->disk.block_size - 1) / fs->disk.block_size;
+                if (!zero_blocks(fs, file, &file_inode, size_blocks, bytepos / fs->disk.block_size))
                 {
-                    // get block number of allocated blocks
-                    for (int i = start_block; i <= eof_block; i++)
-                    {
-                        indexes[i - start_block] = get_block_num(file_inode, i);
-                    }
-                    // allocate new blocks and put into inode
-                    for (int i = eof_block + 1; i <= end_block; i++)
-                    {
-                        int new_block_num = get_free_block();
-                        if (new_block_num == -1)
-                        {
-                            fserror = FS_OUT_OF_SPACE;
-                            break;
-                        }
-                        // when it hits single indirect block in inode
-                        if (i == 12)
-                        {
-                            set_direct_block_num(file_inode, i, new_block_num);
-                            // get another block in put into indirect block
-                            new_block_num = get_free_block();
-                            if (new_block_num == -1)
-                            {
-                                fserror = FS_OUT_OF_SPACE;
-                                break;
-                            }
-                        }
-                        set_block_num(file_inode, i, new_block_num);
-                        cur_num_blocks++;
-                        indexes[i - start_block] = new_block_num;
-                    }
-                    set_blocks_in_inode(file_inode, cur_num_blocks);
+                    fserror = FS_IO_ERROR;
+                    return 0;
                 }
+                set_size_in_inode(fs, &file_inode, bytepos + 1);
+                write_inode(fs, &file_inode, file->file_no);
+                mark_inode_dirty(fs, file->file_no);
+                write_back_if_due(fs);
+            }
+            fserror = FS_NONE;
+            file->cur_pos = bytepos;
+            return 1;
+        }
+        else
+        {
+            fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+            return 0;
+        }
+    }
+    else
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+}
 
-                // calculate actual need block in case disk full
-                const int ACTUAL_NEEDED_BLOCKS = cur_num_blocks - file->cur_pos / SOFTWARE_DISK_BLOCK_SIZE;
+unsigned long pread_file(File file, void *buf, unsigned long numbytes, unsigned long offset)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (file->is_open)
+        {
+            // buffered writes first, they may be what is read
+            if (!flush_write_buffer(fs, file))
+                return 0;
+            FileIOVec seg = {buf, numbytes};
+            return read_at(fs, file, &seg, 1, offset);
+        }
+        else
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
+    }
+    else
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+}
 
-                // re-calculate numbytes_written in case disk full
-                if (fserror == FS_OUT_OF_SPACE)
+unsigned long pwrite_file(File file, void *buf, unsigned long numbytes, unsigned long offset)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (file->is_open)
+        {
+            if (file->mode == READ_WRITE)
+            {
+                if (offset >= fs->disk.max_file_size)
                 {
-                    numbytes_written = cur_num_blocks * SOFTWARE_DISK_BLOCK_SIZE - file->cur_pos;
+                    fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+                    return 0;
                 }
+                if (!flush_write_buffer(fs, file))
+                    return 0;
+
+                // a write past the end of file leaves a hole up to offset
+                FileIOVec seg = {buf, numbytes};
+                unsigned long numbytes_written = write_through(fs, file, &seg, 1, offset);
+                write_back_if_due(fs);
+                return numbytes_written;
+            }
+            else
+            {
+                fserror = FS_FILE_READ_ONLY;
+                return 0;
+            }
+        }
+        else
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
+    }
+    else
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+}
+
+unsigned long readv_file(File file, FileIOVec *iov, int iovcnt)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL && iovcnt >= 0 && (iov != NULL || iovcnt == 0))
+    {
+        if (file->is_open)
+        {
+            // buffered writes first, they may be what is read
+            if (!flush_write_buffer(fs, file))
+                return 0;
+            unsigned long numbytes_read = read_at(fs, file, iov, iovcnt, file->cur_pos);
+            file->cur_pos = file->cur_pos + numbytes_read;
+            return numbytes_read;
+        }
+        else
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
+    }
+    else
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+}
 
-                // write data from buf into file
-                char *charBuf = (char *)buf;
-                int cur_pos = file->cur_pos % SOFTWARE_DISK_BLOCK_SIZE;
-                if (ACTUAL_NEEDED_BLOCKS == 1)
+unsigned long writev_file(File file, FileIOVec *iov, int iovcnt)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL && iovcnt >= 0 && (iov != NULL || iovcnt == 0))
+    {
+        if (file->is_open)
+        {
+            if (file->mode == READ_WRITE)
+            {
+                unsigned long numbytes = segments_length(iov, iovcnt);
+                unsigned long numbytes_written = 0;
+                if (file->wbuf.size > 0 && numbytes < file->wbuf.size && file->cur_pos + numbytes < fs->disk.max_file_size)
                 {
-                    // read from disk
-                    char data[SOFTWARE_DISK_BLOCK_SIZE];
-                    read_sd_block(data, indexes[0]);
-
-                    // only overwrite needed bytes
-                    for (int i = 0; i < numbytes_written; i++)
+                    // small enough to gather each segment in the write buffer
+                    fserror = FS_NONE;
+                    for (int i = 0; i < iovcnt; i++)
                     {
-                        data[cur_pos + i] = charBuf[i];
+                        unsigned long written = buffer_write(fs, file, iov[i].buf, iov[i].len);
+                        numbytes_written += written;
+                        if (written < iov[i].len)
+                            break;
                     }
-
-                    // write to disk
-                    write_sd_block(data, indexes[0]);
                 }
-                else
+                else if (flush_write_buffer(fs, file))
                 {
-                    // handle 1st block
-                    char data[SOFTWARE_DISK_BLOCK_SIZE];
-                    read_sd_block(data, indexes[0]);
-                    for (int i = cur_pos; i < SOFTWARE_DISK_BLOCK_SIZE; i++)
-                    {
-                        data[i] = charBuf[i - cur_pos];
-                    }
-                    write_sd_block(data, indexes[0]);
-
-                    // handle inner blocks, overwrite the whole block
-                    int next_pos = SOFTWARE_DISK_BLOCK_SIZE - cur_pos;
-                    for (int i = 1; i < ACTUAL_NEEDED_BLOCKS - 1; i++)
-                    {
-                        write_sd_block(charBuf + next_pos + (i - 1) * SOFTWARE_DISK_BLOCK_SIZE, indexes[i]);
-                    }
-
-                    // handle last block
-                    read_sd_block(data, indexes[ACTUAL_NEEDED_BLOCKS - 1]);
-                    int end_index = (numbytes_written - next_pos) % SOFTWARE_DISK_BLOCK_SIZE;
-                    for (int i = 0; i < end_index; i++)
-                    {
-                        data[i] = charBuf[next_pos + (ACTUAL_NEEDED_BLOCKS - 2) * SOFTWARE_DISK_BLOCK_SIZE + i];
-                    }
-                    write_sd_block(data, indexes[ACTUAL_NEEDED_BLOCKS - 1]);
+                    numbytes_written = write_through(fs, file, iov, iovcnt, file->cur_pos);
+                    file->cur_pos = file->cur_pos + numbytes_written;
                 }
-
-                // update file_size
-                int new_file_size = file->cur_pos + numbytes_written;
-                file_size = file_size > new_file_size ? file_size : new_file_size;
-                file->cur_pos = file_size;
-                set_size_in_inode(file_inode, file_size);
-                write_inode(file_inode, file->file_no);
-
-                // write fs changes to disk
-                write_inode_to_disk(file->file_no);
-                write_bitmap_to_disk();
-
+                write_back_if_due(fs);
                 return numbytes_written;
             }
             else
@@ -1350,102 +4020,152 @@ unsigned long write_file(File file, void *buf, unsigned long numbytes)
     }
 }
 
-int seek_file(File file, unsigned long bytepos)
+unsigned long read_file_borrow(File file, unsigned long numbytes, FileSpan *spans, int maxspans, int *numspans)
 {
-    if (!is_init)
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (numspans != NULL)
+        *numspans = 0;
+    if (file != NULL && spans != NULL && numspans != NULL)
     {
-        is_init = 1;
-        init_fs();
+        if (file->is_open)
+        {
+            // buffered writes first, they may be what is read
+            if (!flush_write_buffer(fs, file))
+                return 0;
+            unsigned long numbytes_read = borrow_at(fs, file, numbytes, spans, maxspans, numspans, file->cur_pos);
+            file->cur_pos = file->cur_pos + numbytes_read;
+            return numbytes_read;
+        }
+        else
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
     }
-    if (file != NULL)
+    else
     {
-        if (bytepos < MAX_FILE_SIZE)
-        { // get file_inode
-            char file_inode[INODE_SIZE];
-            read_inode(file_inode, file->file_no);
-
-            int file_size = get_size_in_inode(file_inode);
-            int eof_pos = file_size > 0 ? (file_size - 1) : 0;
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+}
 
-            int extend_bytes = 0;
-            int needed_blocks = 0;
+void release_file_borrow(File file)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (file->is_open)
+        {
+            release_borrowed(fs, file);
+            fserror = FS_NONE;
+        }
+        else
+            fserror = FS_FILE_NOT_OPEN;
+    }
+    else
+        fserror = FS_IO_ERROR;
+}
 
-            // HANDLE EMPTY FILE
-            if (file_size == 0)
-            {
-                extend_bytes = bytepos;
-                needed_blocks = extend_bytes / SOFTWARE_DISK_BLOCK_SIZE + 1;
-            }
-            // WHEN FILE NOT EMPTY
-            else if (bytepos > eof_pos)
-            {
-                extend_bytes = bytepos - eof_pos;
-                // reamaing bytes to full block from eof
-                int remain_bytes = SOFTWARE_DISK_BLOCK_SIZE - eof_pos % SOFTWARE_DISK_BLOCK_SIZE;
+int set_write_buffer(File file, unsigned long size)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file == NULL)
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    if (!file->is_open)
+    {
+        fserror = FS_FILE_NOT_OPEN;
+        return 0;
+    }
+    if (file->mode != READ_WRITE)
+    {
+        fserror = FS_FILE_READ_ONLY;
+        return 0;
+    }
+    if (!flush_write_buffer(fs, file))
+        return 0;
 
-                // needed to extend file
-                needed_blocks = (extend_bytes - remain_bytes) / SOFTWARE_DISK_BLOCK_SIZE + 1;
-            }
-            else
-            {
-                fserror = FS_NONE;
-                file->cur_pos = bytepos;
-                return 1;
-            }
+    // whole blocks, so that a full buffer ends on a block boundary
+    size = (size + fs->disk.block_size - 1) / fs->disk.block_size * fs->disk.block_size;
+    if (size > file->wbuf.allocated)
+    {
+        char *data = realloc(file->wbuf.data, size);
+        if (data == NULL)
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+        file->wbuf.data = data;
+        file->wbuf.allocated = size;
+    }
+    file->wbuf.size = size;
+    fserror = FS_NONE;
+    return 1;
+}
 
-            // current number of blocks for file
-            int cur_num_blocks = get_blocks_in_inode(file_inode);
-            int start_block = cur_num_blocks;
+unsigned long file_length(File file)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        Inode file_inode;
+        int success = read_inode(fs, &file_inode, file->file_no);
+        if (!success)
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+        fserror = FS_NONE;
+        // bytes waiting in the write buffer may extend the file
+        unsigned long length = get_size_in_inode(&file_inode);
+        if (file->wbuf.len > 0 && file->wbuf.start + file->wbuf.len > length)
+            length = file->wbuf.start + file->wbuf.len;
+        return length;
+    }
+    else
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+}
 
-            // expected end_block
-            int expected_end_block = start_block + needed_blocks - 1;
-            for (int i = start_block; i <= expected_end_block; i++)
+int truncate_file(File file, unsigned long len)
+{
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
+    if (file != NULL)
+    {
+        if (file->is_open)
+        {
+            if (file->mode == READ_WRITE)
             {
-                int block_num = get_free_block();
-                if (block_num == -1)
+                if (len >= fs->disk.max_file_size)
                 {
-                    fserror = FS_OUT_OF_SPACE;
-                    break;
+                    fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+                    return 0;
                 }
-                if (i == 12)
+                // borrowed blocks must not be freed under the borrower
+                if (file->borrowed.count > 0)
                 {
-                    set_direct_block_num(file_inode, i, block_num);
-                    // get another block in put into indirect block
-                    block_num = get_free_block();
-                    if (block_num == -1)
-                    {
-                        fserror = FS_OUT_OF_SPACE;
-                        break;
-                    }
+                    fserror = FS_IO_ERROR;
+                    return 0;
                 }
-                set_block_num(file_inode, i, block_num);
-                cur_num_blocks++;
-            }
-            set_blocks_in_inode(file_inode, cur_num_blocks);
-            if (fserror == FS_OUT_OF_SPACE)
-            {
-                file_size = cur_num_blocks * SOFTWARE_DISK_BLOCK_SIZE;
+                if (!flush_write_buffer(fs, file))
+                    return 0;
+                int success = truncate_at(fs, file, len);
+                write_back_if_due(fs);
+                return success;
             }
             else
             {
-                file_size = bytepos + 1;
+                fserror = FS_FILE_READ_ONLY;
+                return 0;
             }
-
-            // seek to appropriate position
-            file->cur_pos = file_size - 1;
-
-            // update file_size
-            set_size_in_inode(file_inode, file_size);
-            write_inode(file_inode, file->file_no);
-
-            // write changes to disk
-            write_inode_to_disk(file->file_no);
-            write_bitmap_to_disk();
-            return 1;
         }
         else
         {
-            fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+            fserror = FS_FILE_NOT_OPEN;
             return 0;
         }
     }
@@ -1456,22 +4176,37 @@ int seek_file(File file, unsigned long bytepos)
     }
 }
 
-unsigned long file_length(File file)
+int preallocate_file(File file, unsigned long len)
 {
-    if (!is_init)
-    {
-        is_init = 1;
-        init_fs();
-    }
+    FileSystemInternals *fs = file != NULL ? file->fs : NULL;
     if (file != NULL)
     {
-        char file_inode[INODE_SIZE];
-        int success = read_inode(file_inode, file->file_no);
-        if (success)
-            fserror = FS_NONE;
+        if (file->is_open)
+        {
+            if (file->mode == READ_WRITE)
+            {
+                if (len >= fs->disk.max_file_size)
+                {
+                    fserror = FS_EXCEEDS_MAX_FILE_SIZE;
+                    return 0;
+                }
+                if (!flush_write_buffer(fs, file))
+                    return 0;
+                int success = preallocate_at(fs, file, len);
+                write_back_if_due(fs);
+                return success;
+            }
+            else
+            {
+                fserror = FS_FILE_READ_ONLY;
+                return 0;
+            }
+        }
         else
-            fserror = FS_IO_ERROR;
-        return get_size_in_inode(file_inode);
+        {
+            fserror = FS_FILE_NOT_OPEN;
+            return 0;
+        }
     }
     else
     {
@@ -1480,49 +4215,40 @@ unsigned long file_length(File file)
     }
 }
 
-int delete_file(char *name)
+int fs_delete_file(FileSystem fs, char *name)
 {
-    if (!is_init)
+    int success = 0;
+    int file_no = get_entry(fs, name);
+    if (file_no != -1 && is_opened(fs, file_no))
     {
-        is_init = 1;
-        init_fs();
+        fserror = FS_FILE_OPEN;
     }
-    int success = 0;
-    int file_no = get_entry(name);
-    if (file_no != -1)
+    else if (file_no != -1)
     {
         // get file_inode
-        char file_inode[INODE_SIZE];
-        read_inode(file_inode, file_no);
-        int num_blocks = get_blocks_in_inode(file_inode);
+        Inode file_inode;
+        if (!read_inode(fs, &file_inode, file_no))
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+        int num_blocks = get_blocks_in_inode(&file_inode);
 
         // handle empty file
         if (num_blocks == 0)
         {
-            delete_entry(file_no);
+            delete_entry(fs, file_no);
+            success = 1;
         }
         else
         {
-            char empty_data[SOFTWARE_DISK_BLOCK_SIZE];
-            for (int i = 0; i < SOFTWARE_DISK_BLOCK_SIZE; i++)
-            {
-                empty_data[i] = '\0';
-            }
-
-            // wipe out data and free the blocks
-            for (int i = 0; i < num_blocks; i++)
-            {
-                int block_num = get_block_num(file_inode, i);
-                free_block(block_num);
-                write_sd_block(empty_data, block_num);
-            }
-            delete_entry(file_no);
-
-            // write changes to disk
-            write_bitmap_to_disk();
+            // give back the blocks, the indirect blocks included, see set_scrub_policy()
+            success = free_file_blocks(fs, &file_inode);
+            delete_entry(fs, file_no);
+            if (!success)
+                fserror = FS_IO_ERROR;
         }
-
-        success = 1;
+        write_back_if_due(fs);
     }
     else
     {
@@ -1531,14 +4257,9 @@ int delete_file(char *name)
     return success;
 }
 
-int file_exists(char *name)
+int fs_file_exists(FileSystem fs, char *name)
 {
-    if (!is_init)
-    {
-        is_init = 1;
-        init_fs();
-    }
-    int ret = get_entry(name);
+    int ret = get_entry(fs, name);
     fserror = FS_NONE;
     if (ret == -1)
         return 0;
@@ -1546,13 +4267,147 @@ int file_exists(char *name)
         return 1;
 }
 
-void fs_print_error(void)
+int fs_set_cache_options(FileSystem fs, unsigned long budget, CachePolicy policy)
 {
-    if (!is_init)
+    if (policy != CACHE_LRU && policy != CACHE_CLOCK)
     {
-        is_init = 1;
-        init_fs();
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    // borrowed blocks must stay where they are
+    if (fs->cache.num_pinned > 0)
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    fs->cache_budget = budget;
+    fs->cache_policy = policy;
+    fserror = FS_NONE;
+    if (fs->sd != NULL)
+    {
+        // write back what the old cache holds, then start over
+        if (!flush_cache(&fs->cache) || !init_block_cache(fs))
+        {
+            fserror = FS_IO_ERROR;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int fs_set_block_mapping(FileSystem fs, BlockMapping mapping)
+{
+    if (mapping != MAPPING_BLOCKS && mapping != MAPPING_EXTENTS)
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    fs->block_mapping = mapping;
+    fserror = FS_NONE;
+    return 1;
+}
+
+int fs_set_scrub_policy(FileSystem fs, ScrubPolicy policy)
+{
+    if (policy != SCRUB_NONE && policy != SCRUB_LAZY && policy != SCRUB_SYNC)
+    {
+        fserror = FS_IO_ERROR;
+        return 0;
+    }
+    fs->scrub_policy = policy;
+    fserror = FS_NONE;
+    return 1;
+}
+
+int fs_sync(FileSystem fs)
+{
+    if (write_back_fs(fs) && sd_sync(fs->sd))
+    {
+        fserror = FS_NONE;
+        return 1;
+    }
+    fserror = FS_IO_ERROR;
+    return 0;
+}
+
+int fs_flush(FileSystem fs)
+{
+    if (write_back_fs(fs))
+    {
+        fserror = FS_NONE;
+        return 1;
     }
+    fserror = FS_IO_ERROR;
+    return 0;
+}
+
+void fs_get_stats(FileSystem fs, FSStats *stats)
+{
+    memset(stats, 0, sizeof(FSStats));
+    stats->cache_hits = fs->cache.stats.hits;
+    stats->cache_misses = fs->cache.stats.misses;
+    stats->cache_evictions = fs->cache.stats.evictions;
+    stats->cache_writebacks = fs->cache.stats.writebacks;
+    stats->dir_lookups = fs->dir.lookups;
+    stats->dir_probes = fs->dir.probes;
+    stats->free_blocks = fs->bitmap.free_blocks;
+    stats->readahead_blocks = fs->readahead_blocks;
+    stats->readahead_hits = fs->readahead_hits;
+    fserror = FS_NONE;
+}
+
+File open_file(char *name, FileMode mode)
+{
+    return fs_open_file(get_default_fs(), name, mode);
+}
+
+File create_file(char *name)
+{
+    return fs_create_file(get_default_fs(), name);
+}
+
+int delete_file(char *name)
+{
+    return fs_delete_file(get_default_fs(), name);
+}
+
+int file_exists(char *name)
+{
+    return fs_file_exists(get_default_fs(), name);
+}
+
+int set_cache_options(unsigned long budget, CachePolicy policy)
+{
+    return fs_set_cache_options(&default_fs, budget, policy);
+}
+
+int set_block_mapping(BlockMapping mapping)
+{
+    return fs_set_block_mapping(&default_fs, mapping);
+}
+
+int set_scrub_policy(ScrubPolicy policy)
+{
+    return fs_set_scrub_policy(&default_fs, policy);
+}
+
+int sync_fs()
+{
+    return fs_sync(get_default_fs());
+}
+
+int flush_fs()
+{
+    return fs_flush(get_default_fs());
+}
+
+void get_fs_stats(FSStats *stats)
+{
+    fs_get_stats(&default_fs, stats);
+}
+
+void fs_print_error(void)
+{
     switch (fserror)
     {
     case FS_NONE:
@@ -1565,7 +4420,7 @@ void fs_print_error(void)
         printf("attempted read/write/close/etc. on file that isn't open.\n");
         break;
     case FS_FILE_OPEN:
-        printf("file is already open. Concurrent opens are not supported and neither is deleting a file that is open.\n");
+        printf("file is already open. Any number of READ_ONLY opens may share a file, a READ_WRITE open can't share it and a file that is open can't be deleted.\n");
         break;
     case FS_FILE_NOT_FOUND:
         printf("attempted open or delete of file that doesn't exist.\n");
@@ -1,6 +1,12 @@
+#include "softwaredisk.h"
+
 // file type used by user code
 typedef struct FileInternals *File;
 
+// filesystem mounted on a software disk with fs_mount().  A filesystem and
+// its files may be used from any thread, but from one thread at a time.
+typedef struct FileSystemInternals *FileSystem;
+
 // access mode for open_file()
 typedef enum
 {
@@ -8,14 +14,65 @@ typedef enum
   READ_WRITE
 } FileMode;
 
+// replacement policy of the block cache, see set_cache_options()
+typedef enum
+{
+  CACHE_LRU,
+  CACHE_CLOCK
+} CachePolicy;
+
+// how a file maps its blocks, see set_block_mapping()
+typedef enum
+{
+  MAPPING_BLOCKS,
+  MAPPING_EXTENTS
+} BlockMapping;
+
+// what happens to the old data of the blocks files give back, see set_scrub_policy()
+typedef enum
+{
+  SCRUB_NONE,
+  SCRUB_LAZY,
+  SCRUB_SYNC
+} ScrubPolicy;
+
+// filesystem statistics, see get_fs_stats()
+typedef struct FSStats
+{
+  unsigned long cache_hits;       // block reads served from the block cache
+  unsigned long cache_misses;     // block reads that went to the software disk
+  unsigned long cache_evictions;  // cached blocks replaced to make room
+  unsigned long cache_writebacks; // dirty cached blocks written to the software disk
+  unsigned long dir_lookups;      // file name lookups in the directory
+  unsigned long dir_probes;       // directory entries compared by those lookups
+  unsigned long free_blocks;      // data blocks not allocated to any file
+  unsigned long readahead_blocks; // blocks prefetched for sequential readers
+  unsigned long readahead_hits;   // prefetched blocks that were then read
+} FSStats;
+
+// one segment of a scatter/gather transfer, see readv_file() and writev_file()
+typedef struct FileIOVec
+{
+  void *buf;
+  unsigned long len;
+} FileIOVec;
+
+// a read-only piece of a file borrowed from the block cache, see read_file_borrow()
+typedef struct FileSpan
+{
+  const void *data;
+  unsigned long len;
+} FileSpan;
+
 // error codes set in global 'fserror' by filesystem functions
 typedef enum
 {
   FS_NONE,
   FS_OUT_OF_SPACE,          // the operation caused the software disk to fill up
   FS_FILE_NOT_OPEN,         // attempted read/write/close/etc. on file that isn’t open
-  FS_FILE_OPEN,             // file is already open. Concurrent opens are not
-                            // supported and neither is deleting a file that is open.
+  FS_FILE_OPEN,             // file is already open. Any number of READ_ONLY opens
+                            // may share a file, a READ_WRITE open can't share it and
+                            // a file that is open can't be deleted.
   FS_FILE_NOT_FOUND,        // attempted open or delete of file that doesn’t exist
   FS_FILE_READ_ONLY,        // attempted write to file opened for READ_ONLY
   FS_FILE_ALREADY_EXISTS,   // attempted creation of file with existing name
@@ -24,10 +81,14 @@ typedef enum
   FS_IO_ERROR               // something really bad happened
 } FSError;
 
-// function prototypes for filesystem API
+// function prototypes for filesystem API.  Functions taking a name operate on
+// the default filesystem, mounted on the default software disk on first use;
+// each has an fs_ counterpart below taking a FileSystem.  Functions taking a
+// File operate on the filesystem the file was opened on.
 
 // open existing file with pathname 'name' and access mode 'mode'.  Current file
-// position is set at byte 0.  Returns NULL on error. Always sets 'fserror' global.
+// position is set at byte 0.  Each open returns its own File with its own
+// position.  Returns NULL on error. Always sets 'fserror' global.
 File open_file(char *name, FileMode mode);
 
 // create and open new file with pathname 'name' and (implied) access
@@ -49,15 +110,76 @@ unsigned long read_file(File file, void *buf, unsigned long numbytes);
 // less than 'numbytes'.  Always sets 'fserror' global.
 unsigned long write_file(File file, void *buf, unsigned long numbytes);
 
+// read_file() at byte 'offset' instead of the current file position, which is
+// left unchanged.  Always sets 'fserror' global.
+unsigned long pread_file(File file, void *buf, unsigned long numbytes, unsigned long offset);
+
+// write_file() at byte 'offset' instead of the current file position, which is
+// left unchanged.  A write past the end of file extends the file up to 'offset'
+// first, as seek_file() does.  Always sets 'fserror' global.
+unsigned long pwrite_file(File file, void *buf, unsigned long numbytes, unsigned long offset);
+
+// read_file() into the 'iovcnt' segments of 'iov' in turn, filling each before
+// the next.  Returns the number of bytes read. Always sets 'fserror' global.
+unsigned long readv_file(File file, FileIOVec *iov, int iovcnt);
+
+// write_file() of the 'iovcnt' segments of 'iov' in turn, as one write: the
+// blocks are allocated and the file size updated once, and whole blocks move
+// straight between the segments and the disk.  Returns the number of bytes
+// written. Always sets 'fserror' global.
+unsigned long writev_file(File file, FileIOVec *iov, int iovcnt);
+
+// read_file() without copying: borrows at most 'numbytes' of 'file' from the
+// current file position, which moves past them, in place in the block cache.
+// Up to 'maxspans' entries of 'spans' get a pointer to and the length of each
+// borrowed piece, one per block, and '*numspans' gets their number.  Fewer
+// bytes than 'numbytes' are borrowed at end of file, when the spans run out
+// and when half of the block cache is borrowed already, down to none with
+// 'fserror' FS_NONE.  The data must not be modified and stays valid until
+// release_file_borrow() or close_file().
+// Writes through the same handle to blocks the file already had show in it
+// once they leave the write buffer; a hole is lent as a shared block of zeros
+// and stays zeros after it is written.  Returns the number of bytes borrowed.
+// Always sets 'fserror' global.
+unsigned long read_file_borrow(File file, unsigned long numbytes, FileSpan *spans, int maxspans, int *numspans);
+
+// gives back everything borrowed with read_file_borrow() on 'file'.  Always
+// sets 'fserror' global.
+void release_file_borrow(File file);
+
 // sets current position in file to 'bytepos', always relative to the
 // beginning of file.  Seeks past the current end of file should
-// extend the file. Returns 1 on success and 0 on failure.  Always
-// sets 'fserror' global.
+// extend the file, with a hole: the new bytes read as zeros and take
+// no disk blocks until they are written. Returns 1 on success and 0 on
+// failure.  Always sets 'fserror' global.
 int seek_file(File file, unsigned long bytepos);
 
+// gives 'file', opened READ_WRITE, a write buffer of 'size' bytes, rounded up to
+// whole blocks (0, the default, turns it off). Writes smaller than the buffer are
+// gathered in it and written as whole blocks when it fills up to a block boundary,
+// and on seek_file(), read_file(), close_file(), flush_fs() and sync_fs(). An error
+// of a buffered write, such as FS_OUT_OF_SPACE, is set by the call that writes the
+// buffer. Returns 1 on success, 0 on failure. Always sets 'fserror' global.
+int set_write_buffer(File file, unsigned long size);
+
 // returns the current length of the file in bytes. Always sets 'fserror' global.
 unsigned long file_length(File file);
 
+// sets the length of 'file', opened READ_WRITE, to 'len' bytes.  The blocks past
+// the new end, preallocated ones included, are freed at once, see set_scrub_policy(),
+// and a longer length extends the file with a hole, as seek_file() does.  The
+// current file position is left unchanged.  Fails while blocks of 'file' are
+// borrowed, see read_file_borrow().  Returns 1 on success, 0 on failure.
+// Always sets 'fserror' global.
+int truncate_file(File file, unsigned long len);
+
+// gives the first 'len' bytes of 'file', opened READ_WRITE, their blocks up front,
+// consecutive where the disk has room, so later writes up to there allocate
+// nothing.  The length of the file is left unchanged; blocks past its end stay
+// with it until truncate_file().  On an out of space error some blocks may have
+// been given.  Returns 1 on success, 0 on failure.  Always sets 'fserror' global.
+int preallocate_file(File file, unsigned long len);
+
 // deletes the file named 'name', if it exists. Returns 1 on success, 0 on failure.
 // Always sets 'fserror' global.
 int delete_file(char *name);
@@ -66,9 +188,74 @@ int delete_file(char *name);
 // Always sets 'fserror' global.
 int file_exists(char *name);
 
+// sets the memory budget in bytes and the replacement policy of the block
+// cache between the filesystem and the software disk (default 1 MB, LRU).
+// Cached blocks are written back first.  Fails while blocks are borrowed, see
+// read_file_borrow().  Returns 1 on success, 0 on failure.  Always sets
+// 'fserror' global.
+int set_cache_options(unsigned long budget, CachePolicy policy);
+
+// sets how the files created from now on map their blocks.  MAPPING_BLOCKS (the
+// default) keeps a block number per block, in the inode and its indirect blocks;
+// MAPPING_EXTENTS keeps runs of consecutive blocks, a first block and a length
+// each, so a file written in large pieces maps with a few extents and moves each
+// one in a single transfer.  A file keeps the mapping it was created with.
+// Returns 1 on success, 0 on failure.  Always sets 'fserror' global.
+int set_block_mapping(BlockMapping mapping);
+
+// sets what happens to the old data of the blocks files give back, by
+// delete_file() and truncate_file().  SCRUB_SYNC writes zeros over them before the
+// call returns; a block the zeros can't be written to is not freed, and the call
+// fails with FS_IO_ERROR.  SCRUB_LAZY (the default) only frees them, so the call
+// returns at once, and a block is cleared when it is allocated again: a write
+// covers it whole, and preallocate_file() writes zeros over it.  SCRUB_NONE also
+// leaves preallocated blocks past the end of file as they were until they are
+// written.  With any policy a file reads as zeros where it was not
+// written.  Returns 1 on success, 0 on failure.  Always sets 'fserror' global.
+int set_scrub_policy(ScrubPolicy policy);
+
+// Changes to the inodes, the directory and the free block bitmap are held in
+// memory.  They move to the block cache on close_file(), and on the next write,
+// seek, truncate or delete once they are 5 seconds old; flush_fs() and sync_fs()
+// write them to the software disk.  There is no background timer: after its
+// last change a program must call flush_fs() or sync_fs() for them to reach the
+// software disk, sync_fs() to make them durable.
+
+// writes every modified block held in the block cache back to the software
+// disk. Also done when the program exits. Returns 1 on success, 0 on failure.
+// Always sets 'fserror' global.
+int flush_fs();
+
+// durability barrier: writes back the block cache, then makes everything
+// written to the software disk durable regardless of its sync policy.
+// Returns 1 on success, 0 on failure. Always sets 'fserror' global.
+int sync_fs();
+
+// copies the filesystem statistics into 'stats'. Always sets 'fserror' global.
+void get_fs_stats(FSStats *stats);
+
+// mounts the filesystem on software disk 'sd', which must stay open until
+// fs_unmount(). Returns NULL on error. Always sets 'fserror' global.
+FileSystem fs_mount(SoftwareDisk sd);
+
+// writes back the block cache of 'fs' and releases it. Every file of 'fs'
+// must be closed. Returns 1 on success, 0 on failure. Always sets 'fserror' global.
+int fs_unmount(FileSystem fs);
+
+File fs_open_file(FileSystem fs, char *name, FileMode mode);
+File fs_create_file(FileSystem fs, char *name);
+int fs_delete_file(FileSystem fs, char *name);
+int fs_file_exists(FileSystem fs, char *name);
+int fs_set_cache_options(FileSystem fs, unsigned long budget, CachePolicy policy);
+int fs_set_block_mapping(FileSystem fs, BlockMapping mapping);
+int fs_set_scrub_policy(FileSystem fs, ScrubPolicy policy);
+int fs_flush(FileSystem fs);
+int fs_sync(FileSystem fs);
+void fs_get_stats(FileSystem fs, FSStats *stats);
+
 // describe current filesystem error code by printing a descriptive message to standard
 // error.
 void fs_print_error(void);
 
-// filesystem error code set (set by each filesystem function)
-extern FSError fserror;
\ No newline at end of file
+// filesystem error code set (set by each filesystem function), one per thread
+extern _Thread_local FSError fserror;
\ No newline at end of file
@@ -3,133 +3,979 @@
 // Written by Golden G. Richard III (@nolaforensix), 10/2017.
 //
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "softwaredisk.h"
 
+// default geometry, also the geometry of images without a header
 #define NUM_BLOCKS 5000
 #define BACKING_STORE "sdprivate.sd"
 
+// environment variable selecting the backend when the program doesn't:
+// "file", "mmap" or "ram"
+#define BACKEND_ENV "SOFTWARE_DISK_BACKEND"
+
+#define HEADER_MAGIC "LSUSWDSK"
+#define HEADER_VERSION 1
+
+// default group commit: one fdatasync() per 64 writes or 10 ms
+#define GROUP_COMMIT_OPS 64
+#define GROUP_COMMIT_USECS 10000
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// header at the front of the backing store, padded to one block so that
+// block 0 starts block aligned.  Images written before the header existed
+// have none and use the default geometry.
+typedef struct SDHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t num_blocks;
+} SDHeader;
+
 // internals of software disk implementation
 typedef struct SoftwareDiskInternals {
-  FILE *fp;       
+  char path[PATH_MAX];             // backing store, also the snapshot file of SD_BACKEND_RAM
+  int fd;                          // backing store, -1 when not open or SD_BACKEND_RAM
+  unsigned long num_blocks;        // geometry of the open backing store
+  unsigned long block_size;
+  unsigned long data_offset;       // byte offset of block 0, i.e. the header size
+  unsigned long format_blocks;     // geometry for the next sd_init(),
+  unsigned long format_block_size; // 0 selects the default
+  SDBackend backend;               // backend used the next time the backing store is opened
+  int backend_chosen;              // backend set by the program or from the environment
+  SDFormatMode format_mode;        // how sd_init() zeroes the store
+  unsigned long format_time;       // duration of the last init, in microseconds
+  SDSyncPolicy sync_policy;        // when written blocks are made durable
+  unsigned long group_ops;         // SD_SYNC_GROUP: writes per sync
+  unsigned long group_usecs;       // SD_SYNC_GROUP: max age of an unsynced write
+  unsigned long pending_ops;       // writes since the last sync
+  struct timespec first_pending;   // time of the oldest unsynced write
+  char *map;                       // SD_BACKEND_MMAP: the whole backing store, mapped shared
+                                   // SD_BACKEND_RAM: the blocks, mapped anonymous
+  unsigned char *dirty;            // SD_BACKEND_MMAP: one flag per block written since last sync
+  unsigned long dirty_lo;          // lowest dirty block number
+  unsigned long dirty_hi;          // one past the highest dirty block number
 } SoftwareDiskInternals;
 
 //
 // GLOBALS
 //
 
-static SoftwareDiskInternals sd;
+// the software disk behind the API without a handle
+static SoftwareDiskInternals default_sd={
+  .path=BACKING_STORE,
+  .fd=-1,
+  .group_ops=GROUP_COMMIT_OPS,
+  .group_usecs=GROUP_COMMIT_USECS
+};
 
-// software disk error code set (set by each software disk function).
-SDError sderror;
 
+// returns the size in bytes of the open backing store, header included
+static unsigned long store_size(SoftwareDisk sd) {
 
-// initializes the software disk to all zeros, destroying any existing
-// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
-int init_software_disk() {
-  int i;
-  char block[SOFTWARE_DISK_BLOCK_SIZE];
-  sderror=SD_NONE;
-  sd.fp=fopen(BACKING_STORE, "w+");
-  if (! sd.fp) {
-    sderror=SD_INTERNAL_ERROR;
+  return sd->data_offset + sd->num_blocks * sd->block_size;
+}
+
+// returns the byte offset of block 'blocknum' in the backing store
+static off_t block_offset(SoftwareDisk sd, unsigned long blocknum) {
+
+  return (off_t)sd->data_offset + (off_t)blocknum * sd->block_size;
+}
+
+// returns the microseconds elapsed since 'start'
+static unsigned long usecs_since(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000UL +
+    (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// picks the backend from the environment unless the program already chose one.
+static void choose_backend(SoftwareDisk sd) {
+  char *name;
+
+  if (sd->backend_chosen) {
+    return;
+  }
+  sd->backend_chosen=1;
+  name=getenv(BACKEND_ENV);
+  if (! name) {
+    return;
+  }
+  if (strcmp(name, "mmap") == 0) {
+    sd->backend=SD_BACKEND_MMAP;
+  }
+  else if (strcmp(name, "ram") == 0) {
+    sd->backend=SD_BACKEND_RAM;
+  }
+  else {
+    sd->backend=SD_BACKEND_FILE;
+  }
+}
+
+// returns 1 if the software disk has blocks to access, otherwise 0
+static int is_open(SoftwareDisk sd) {
+
+  return sd->fd != -1 || sd->map != NULL;
+}
+
+// allocates zeroed memory for the blocks of an SD_BACKEND_RAM disk with the
+// geometry in 'sd'.  Returns 1 on success, otherwise 0.
+static int allocate_ram_disk(SoftwareDisk sd) {
+  void *p;
+
+  sd->data_offset=0;
+  p=mmap(NULL, store_size(sd), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
     return 0;
   }
-  
-  bzero(block, SOFTWARE_DISK_BLOCK_SIZE);
-  for (i=0; i < NUM_BLOCKS; i++) {
-    if (fwrite(block, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
-      fclose(sd.fp);
-      sd.fp=NULL;
-      sderror=SD_INTERNAL_ERROR;
+  sd->map=p;
+  return 1;
+}
+
+// maps the open backing store into memory for SD_BACKEND_MMAP.  Returns 1
+// on success, otherwise 0.
+static int map_backing_store(SoftwareDisk sd) {
+  void *p;
+
+  if (sd->backend != SD_BACKEND_MMAP) {
+    return 1;
+  }
+  p=mmap(NULL, store_size(sd), PROT_READ | PROT_WRITE, MAP_SHARED, sd->fd, 0);
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+  sd->dirty=calloc(sd->num_blocks, 1);
+  if (! sd->dirty) {
+    munmap(p, store_size(sd));
+    return 0;
+  }
+  sd->map=p;
+  sd->dirty_lo=sd->num_blocks;
+  sd->dirty_hi=0;
+  return 1;
+}
+
+// unmaps (if mapped) and closes the backing store.  The blocks of an
+// SD_BACKEND_RAM disk are gone afterwards.
+static void close_backing_store(SoftwareDisk sd) {
+  if (sd->map) {
+    munmap(sd->map, store_size(sd));
+    sd->map=NULL;
+  }
+  free(sd->dirty);
+  sd->dirty=NULL;
+  if (sd->fd != -1) {
+    close(sd->fd);
+    sd->fd=-1;
+  }
+  sd->pending_ops=0;
+}
+
+// returns 1 if 'block_size' is a supported block size, otherwise 0
+static int valid_block_size(unsigned long block_size) {
+
+  return block_size >= SOFTWARE_DISK_BLOCK_SIZE &&
+    block_size <= SOFTWARE_DISK_MAX_BLOCK_SIZE &&
+    (block_size & (block_size - 1)) == 0;
+}
+
+// sets the geometry in 'sd' from the header of the image open on 'fd',
+// falling back to the default geometry for images without one.  Returns 1
+// if the size of the image matches the geometry, otherwise 0.
+static int read_header(SoftwareDisk sd, int fd) {
+  SDHeader header;
+  struct stat st;
+
+  if (fstat(fd, &st) != 0) {
+    return 0;
+  }
+  if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+      memcmp(header.magic, HEADER_MAGIC, sizeof(header.magic)) == 0) {
+    if (header.version != HEADER_VERSION || ! valid_block_size(header.block_size)) {
       return 0;
     }
+    sd->num_blocks=header.num_blocks;
+    sd->block_size=header.block_size;
+    sd->data_offset=header.block_size;
+  }
+  else {
+    sd->num_blocks=NUM_BLOCKS;
+    sd->block_size=SOFTWARE_DISK_BLOCK_SIZE;
+    sd->data_offset=0;
+  }
+  return (unsigned long) st.st_size == store_size(sd);
+}
+
+// writes the header for the geometry in 'sd' to the front of the freshly
+// truncated image open on 'fd'.  Returns 1 on success, otherwise 0.
+static int write_header(SoftwareDisk sd, int fd) {
+  char block[sd->block_size];
+  SDHeader header;
+
+  bzero(block, sd->block_size);
+  memcpy(header.magic, HEADER_MAGIC, sizeof(header.magic));
+  header.version=HEADER_VERSION;
+  header.block_size=sd->block_size;
+  header.num_blocks=sd->num_blocks;
+  memcpy(block, &header, sizeof(header));
+  return pwrite(fd, block, sd->block_size, 0) == (ssize_t) sd->block_size;
+}
+
+// opens an existing backing store, if not already open.  Returns 1 on
+// success, otherwise 0 with 'sderror' set.
+static int open_backing_store(SoftwareDisk sd) {
+  if (is_open(sd)) {
+    return 1;
+  }
+  choose_backend(sd);
+  if (sd->backend == SD_BACKEND_RAM) {
+    // nothing to open, the blocks only exist after init or a snapshot load
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  sd->fd=open(sd->path, O_RDWR);
+  if (sd->fd == -1) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (! read_header(sd, sd->fd)) {
+    close(sd->fd);
+    sd->fd=-1;
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  if (! map_backing_store(sd)) {
+    close_backing_store(sd);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
   }
   return 1;
 }
 
-// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
-unsigned long software_disk_size() {
+// records that 'count' blocks starting at 'blocknum' were written through
+// the mapping and need an msync() on the next sync.
+static void mark_dirty(SoftwareDisk sd, unsigned long blocknum, unsigned long count) {
+  unsigned long i;
 
-  return NUM_BLOCKS;
+  if (! sd->dirty) {
+    return;
+  }
+  for (i=blocknum; i < blocknum + count; i++) {
+    sd->dirty[i]=1;
+  }
+  if (blocknum < sd->dirty_lo) {
+    sd->dirty_lo=blocknum;
+  }
+  if (blocknum + count > sd->dirty_hi) {
+    sd->dirty_hi=blocknum + count;
+  }
 }
 
-// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
-// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
-// on success or 0 on failure.  Always sets global 'sderror'.
-int write_sd_block(void *buf, unsigned long blocknum) {
+// applies the sync policy after a successful write.  Returns 1 on success
+// or 0 on failure.
+static int commit_write(SoftwareDisk sd) {
+
+  if (sd->pending_ops++ == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &sd->first_pending);
+  }
+  switch (sd->sync_policy) {
+  case SD_SYNC_EVERY_OP:
+    return sd_sync(sd);
+  case SD_SYNC_GROUP:
+    if (sd->pending_ops >= sd->group_ops ||
+	usecs_since(&sd->first_pending) >= sd->group_usecs) {
+      return sd_sync(sd);
+    }
+    return 1;
+  default:
+    return 1;
+  }
+}
+
+// zeroes the freshly truncated backing store according to sd->format_mode.
+// Returns 1 on success, otherwise 0.
+static int zero_backing_store(SoftwareDisk sd) {
+  unsigned long i;
+  char block[sd->block_size];
+
+  if (sd->format_mode == SD_FORMAT_FAST) {
+    // an extended file reads back as zeros; reserving the space up front is
+    // only an optimization, so filesystems without fallocate() are fine
+    if (ftruncate(sd->fd, store_size(sd)) != 0) {
+      return 0;
+    }
+#ifdef __linux__
+    fallocate(sd->fd, 0, 0, store_size(sd));
+#endif
+    return 1;
+  }
+
+  bzero(block, sd->block_size);
+  for (i=0; i < sd->num_blocks; i++) {
+    if (pwrite(sd->fd, block, sd->block_size, block_offset(sd, i)) != (ssize_t) sd->block_size) {
+      return 0;
+    }
+  }
+  return 1;
+}
 
+// initializes the software disk to all zeros, destroying any existing
+// data.  The geometry is the one last passed to sd_set_geometry(),
+// recorded in a header in front of block 0.  Returns 1 on success, otherwise 0.
+// Always sets global 'sderror'.
+int sd_init(SoftwareDisk sd) {
+  struct timespec start;
   sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  close_backing_store(sd);
+  choose_backend(sd);
+  sd->num_blocks=sd->format_blocks ? sd->format_blocks : NUM_BLOCKS;
+  sd->block_size=sd->format_block_size ? sd->format_block_size : SOFTWARE_DISK_BLOCK_SIZE;
+  sd->data_offset=sd->block_size;
+  if (sd->backend == SD_BACKEND_RAM) {
+    if (! allocate_ram_disk(sd)) {
       sderror=SD_INTERNAL_ERROR;
       return 0;
     }
+    sd->format_time=usecs_since(&start);
+    return 1;
+  }
+
+  sd->fd=open(sd->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (sd->fd == -1) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (! write_header(sd, sd->fd) || ! zero_backing_store(sd)) {
+    close(sd->fd);
+    sd->fd=-1;
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (! map_backing_store(sd)) {
+    close_backing_store(sd);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  sd->format_time=usecs_since(&start);
+  return 1;
+}
+
+// selects how subsequent sd_init() calls zero the backing store.
+// Returns 1 on success, otherwise 0.  Always sets global 'sderror'.
+int sd_set_format_mode(SoftwareDisk sd, SDFormatMode mode) {
+
+  sderror=SD_NONE;
+  if (mode != SD_FORMAT_FAST && mode != SD_FORMAT_SECURE) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  sd->format_mode=mode;
+  return 1;
+}
+
+// returns the time taken by the last sd_init(), in microseconds
+unsigned long sd_format_time(SoftwareDisk sd) {
+
+  return sd->format_time;
+}
+
+// sets the geometry used by subsequent sd_init() calls.
+// 'block_size' must be a power of two between SOFTWARE_DISK_BLOCK_SIZE and
+// SOFTWARE_DISK_MAX_BLOCK_SIZE.  Returns 1 on success, otherwise 0.  Always
+// sets global 'sderror'.
+int sd_set_geometry(SoftwareDisk sd, unsigned long num_blocks, unsigned long block_size) {
+
+  sderror=SD_NONE;
+  if (num_blocks == 0 || ! valid_block_size(block_size)) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  sd->format_blocks=num_blocks;
+  sd->format_block_size=block_size;
+  return 1;
+}
+
+// returns the size of the SoftwareDisk in blocks, or 0 if there is no
+// usable software disk
+unsigned long sd_size(SoftwareDisk sd) {
+
+  if (! open_backing_store(sd)) {
+    return 0;
+  }
+  return sd->num_blocks;
+}
+
+// returns the block size of the SoftwareDisk in bytes, or 0 if there is no
+// usable software disk
+unsigned long sd_block_size(SoftwareDisk sd) {
+
+  if (! open_backing_store(sd)) {
+    return 0;
+  }
+  return sd->block_size;
+}
+
+// moves one run of consecutive blocks starting at 'blocknum' between the
+// backing store and the buffers in 'iov', retrying on short transfers.
+// Returns 1 on success or 0 on failure.
+static int transfer_run(SoftwareDisk sd, int write, struct iovec *iov, int iovcnt, unsigned long blocknum) {
+  off_t off=block_offset(sd, blocknum);
+  ssize_t n;
+
+  while (iovcnt > 0) {
+    if (write) {
+      n=pwritev(sd->fd, iov, iovcnt, off);
+    }
     else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
+      n=preadv(sd->fd, iov, iovcnt, off);
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    off+=n;
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n-=iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base=(char *) iov->iov_base + n;
+      iov->iov_len-=n;
+    }
+  }
+  return 1;
+}
+
+// common code for sd_read_blocks() and sd_write_blocks()
+static int transfer_blocks(SoftwareDisk sd, int write, SDBlockIO *ios, unsigned long count) {
+  struct iovec iov[IOV_MAX];
+  unsigned long i, start;
+  int iovcnt;
+
+  sderror=SD_NONE;
+  if (! open_backing_store(sd)) {
+    return 0;
+  }
+  for (i=0; i < count; i++) {
+    if (ios[i].blocknum > sd->num_blocks-1) {
+      sderror=SD_ILLEGAL_BLOCK_NUMBER;
+      return 0;
+    }
+  }
+
+  if (sd->map) {
+    for (i=0; i < count; i++) {
+      if (write) {
+	bcopy(ios[i].buf, sd->map + block_offset(sd, ios[i].blocknum), sd->block_size);
+	mark_dirty(sd, ios[i].blocknum, 1);
+      }
+      else {
+	bcopy(sd->map + block_offset(sd, ios[i].blocknum), ios[i].buf, sd->block_size);
       }
     }
+    return write ? commit_write(sd) : 1;
   }
 
-  if (blocknum > NUM_BLOCKS-1) {
+  i=0;
+  while (i < count) {
+    // gather the run of consecutive block numbers starting at ios[i]
+    start=i;
+    iovcnt=0;
+    do {
+      iov[iovcnt].iov_base=ios[i].buf;
+      iov[iovcnt].iov_len=sd->block_size;
+      iovcnt++;
+      i++;
+    } while (i < count && iovcnt < IOV_MAX &&
+	     ios[i].blocknum == ios[i-1].blocknum + 1);
+    if (! transfer_run(sd, write, iov, iovcnt, ios[start].blocknum)) {
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+  }
+  return write ? commit_write(sd) : 1;
+}
+
+// common code for the single block and range transfers
+static int transfer_range(SoftwareDisk sd, int write, void *buf, unsigned long blocknum, unsigned long count) {
+  struct iovec iov;
+
+  sderror=SD_NONE;
+  if (! open_backing_store(sd)) {
+    return 0;
+  }
+  if (blocknum > sd->num_blocks-1 || count > sd->num_blocks - blocknum) {
     sderror=SD_ILLEGAL_BLOCK_NUMBER;
     return 0;
   }
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fwrite(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+  if (sd->map) {
+    if (write) {
+      bcopy(buf, sd->map + block_offset(sd, blocknum), count * sd->block_size);
+      mark_dirty(sd, blocknum, count);
+    }
+    else {
+      bcopy(sd->map + block_offset(sd, blocknum), buf, count * sd->block_size);
+    }
+    return write ? commit_write(sd) : 1;
+  }
+
+  iov.iov_base=buf;
+  iov.iov_len=count * sd->block_size;
+  if (! transfer_run(sd, write, &iov, 1, blocknum)) {
     sderror=SD_INTERNAL_ERROR;
     return 0;
   }
-  fflush(sd.fp);
-  return 1;
+  return write ? commit_write(sd) : 1;
 }
 
-// reads a block of data into 'buf' from location 'blocknum'.  Blocks are numbered 
-// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered
+// from 0.  The buffer 'buf' must be of size sd_block_size().  Returns 1
 // on success or 0 on failure.  Always sets global 'sderror'.
-int read_sd_block(void *buf, unsigned long blocknum) {
+int sd_write_block(SoftwareDisk sd, void *buf, unsigned long blocknum) {
+
+  return transfer_range(sd, 1, buf, blocknum, 1);
+}
+
+// reads a block of data into 'buf' from location 'blocknum'.  Blocks are numbered
+// from 0.  The buffer 'buf' must be of size sd_block_size().  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int sd_read_block(SoftwareDisk sd, void *buf, unsigned long blocknum) {
+
+  return transfer_range(sd, 0, buf, blocknum, 1);
+}
+
+// reads 'count' blocks, block ios[i].blocknum into ios[i].buf.  Runs of
+// consecutive block numbers are transferred with a single preadv().
+// Returns 1 on success or 0 on failure.  Always sets global 'sderror'.
+int sd_read_blocks(SoftwareDisk sd, SDBlockIO *ios, unsigned long count) {
+
+  return transfer_blocks(sd, 0, ios, count);
+}
+
+// writes 'count' blocks, ios[i].buf to block ios[i].blocknum.  Runs of
+// consecutive block numbers are transferred with a single pwritev().
+// Returns 1 on success or 0 on failure.  Always sets global 'sderror'.
+int sd_write_blocks(SoftwareDisk sd, SDBlockIO *ios, unsigned long count) {
+
+  return transfer_blocks(sd, 1, ios, count);
+}
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf', which
+// must be of size count * sd_block_size().  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int sd_read_range(SoftwareDisk sd, void *buf, unsigned long blocknum, unsigned long count) {
+
+  return transfer_range(sd, 0, buf, blocknum, count);
+}
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf', which
+// must be of size count * sd_block_size().  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int sd_write_range(SoftwareDisk sd, void *buf, unsigned long blocknum, unsigned long count) {
+
+  return transfer_range(sd, 1, buf, blocknum, count);
+}
+
+// makes every block written since the last sync durable: one fdatasync()
+// for SD_BACKEND_FILE, one msync() per run of consecutive dirty blocks for
+// SD_BACKEND_MMAP.  Returns 1 on success or 0 on failure.  Always sets
+// global 'sderror'.
+int sd_sync(SoftwareDisk sd) {
+  unsigned long i, start, lo, hi;
+  unsigned long pagesize=sysconf(_SC_PAGESIZE);
 
   sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
+  if (sd->fd == -1 || sd->pending_ops == 0) {
+    // SD_BACKEND_RAM has nothing to make durable
+    sd->pending_ops=0;
+    return 1;
+  }
+  if (! sd->map) {
+    if (fdatasync(sd->fd) != 0) {
       sderror=SD_INTERNAL_ERROR;
       return 0;
     }
-    else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
-      }
+    sd->pending_ops=0;
+    return 1;
+  }
+
+  i=sd->dirty_lo;
+  while (i < sd->dirty_hi) {
+    if (! sd->dirty[i]) {
+      i++;
+      continue;
+    }
+    start=i;
+    while (i < sd->dirty_hi && sd->dirty[i]) {
+      sd->dirty[i++]=0;
+    }
+    // msync() wants a page aligned address
+    lo=block_offset(sd, start) & ~(pagesize - 1);
+    hi=block_offset(sd, i);
+    if (msync(sd->map + lo, hi - lo, MS_SYNC) != 0) {
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
     }
   }
+  sd->dirty_lo=sd->num_blocks;
+  sd->dirty_hi=0;
+  sd->pending_ops=0;
+  return 1;
+}
 
-  if (blocknum > NUM_BLOCKS-1) {
-    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+// selects when written blocks are made durable.  For SD_SYNC_GROUP a sync
+// is issued once 'group_ops' writes are pending or the oldest pending write
+// is 'group_usecs' microseconds old, checked on every write; 0 keeps the
+// current value.  Pending writes are synced first.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int sd_set_sync_policy(SoftwareDisk sd, SDSyncPolicy policy, unsigned long group_ops,
+				  unsigned long group_usecs) {
+
+  sderror=SD_NONE;
+  if (policy != SD_SYNC_NONE && policy != SD_SYNC_EVERY_OP && policy != SD_SYNC_GROUP) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (! sd_sync(sd)) {
+    return 0;
+  }
+  sd->sync_policy=policy;
+  if (group_ops) {
+    sd->group_ops=group_ops;
+  }
+  if (group_usecs) {
+    sd->group_usecs=group_usecs;
+  }
+  return 1;
+}
+
+// selects the backend used for the backing store.  An open backing store
+// is synced and closed first, so the change applies to the next block
+// access; the blocks of an SD_BACKEND_RAM disk are discarded.  Returns 1 on
+// success or 0 on failure.  Always sets global 'sderror'.
+int sd_set_backend(SoftwareDisk sd, SDBackend backend) {
+
+  sderror=SD_NONE;
+  if (backend != SD_BACKEND_FILE && backend != SD_BACKEND_MMAP && backend != SD_BACKEND_RAM) {
+    sderror=SD_INTERNAL_ERROR;
     return 0;
   }
+  if (! sd_sync(sd)) {
+    return 0;
+  }
+  close_backing_store(sd);
+  sd->backend=backend;
+  sd->backend_chosen=1;
+  return 1;
+}
+
+// returns the backend of the software disk
+SDBackend sd_backend(SoftwareDisk sd) {
+
+  choose_backend(sd);
+  return sd->backend;
+}
+
+// writes the whole SD_BACKEND_RAM disk, with a header, to the backing store.
+// For the file backed backends the backing store already is the image and
+// this only syncs it.  Returns 1 on success or 0 on failure.  Always sets
+// global 'sderror'.
+int sd_save_snapshot(SoftwareDisk sd) {
+  unsigned long done=0, size;
+  ssize_t n;
+  int fd;
+
+  sderror=SD_NONE;
+  if (! is_open(sd)) {
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  if (sd->backend != SD_BACKEND_RAM) {
+    return sd_sync(sd);
+  }
+
+  fd=open(sd->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1 || ! write_header(sd, fd)) {
+    if (fd != -1) {
+      close(fd);
+    }
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  size=sd->num_blocks * sd->block_size;
+  while (done < size) {
+    n=pwrite(fd, sd->map + done, size - done, sd->block_size + done);
+    if (n <= 0) {
+      close(fd);
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+    done+=n;
+  }
+  if (fsync(fd) != 0) {
+    close(fd);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  close(fd);
+  return 1;
+}
+
+// replaces the SD_BACKEND_RAM disk with the image in the backing store,
+// taking its geometry.  For the file backed backends this reopens the
+// backing store.  Returns 1 on success or 0 on failure.  Always sets global
+// 'sderror'.
+int sd_load_snapshot(SoftwareDisk sd) {
+  unsigned long done=0, size, offset;
+  ssize_t n;
+  int fd;
+
+  sderror=SD_NONE;
+  choose_backend(sd);
+  if (! sd_sync(sd)) {
+    return 0;
+  }
+  close_backing_store(sd);
+  if (sd->backend != SD_BACKEND_RAM) {
+    return open_backing_store(sd);
+  }
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fread(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+  fd=open(sd->path, O_RDONLY);
+  if (fd == -1) {
     sderror=SD_INTERNAL_ERROR;
     return 0;
   }
-  fflush(sd.fp);
+  if (! read_header(sd, fd)) {
+    close(fd);
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  offset=sd->data_offset;
+  if (! allocate_ram_disk(sd)) {
+    close(fd);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  size=sd->num_blocks * sd->block_size;
+  while (done < size) {
+    n=pread(fd, sd->map + done, size - done, offset + done);
+    if (n <= 0) {
+      close(fd);
+      close_backing_store(sd);
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+    done+=n;
+  }
+  close(fd);
   return 1;
 }
 
+// allocates a handle, not yet open, for the backing store 'path'.  Returns
+// NULL on failure.
+static SoftwareDisk new_disk(char *path, SDBackend backend) {
+  SoftwareDisk sd;
+
+  if (strlen(path) >= PATH_MAX ||
+      (backend != SD_BACKEND_FILE && backend != SD_BACKEND_MMAP && backend != SD_BACKEND_RAM)) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  sd=calloc(1, sizeof(SoftwareDiskInternals));
+  if (! sd) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  strcpy(sd->path, path);
+  sd->fd=-1;
+  sd->backend=backend;
+  sd->backend_chosen=1;
+  sd->group_ops=GROUP_COMMIT_OPS;
+  sd->group_usecs=GROUP_COMMIT_USECS;
+  return sd;
+}
+
+// opens the existing software disk image 'path' with 'backend'; an
+// SD_BACKEND_RAM disk is loaded from the image.  Returns the handle, or NULL
+// on failure.  Always sets global 'sderror'.
+SoftwareDisk sd_open(char *path, SDBackend backend) {
+  SoftwareDisk sd;
+  int success;
+
+  sderror=SD_NONE;
+  sd=new_disk(path, backend);
+  if (! sd) {
+    return NULL;
+  }
+  if (backend == SD_BACKEND_RAM) {
+    success=sd_load_snapshot(sd);
+  }
+  else {
+    success=open_backing_store(sd);
+  }
+  if (! success) {
+    free(sd);
+    return NULL;
+  }
+  return sd;
+}
+
+// formats a new software disk of 'num_blocks' blocks of 'block_size' bytes
+// at 'path' with 'backend', destroying any existing image.  Returns the
+// handle, or NULL on failure.  Always sets global 'sderror'.
+SoftwareDisk sd_format(char *path, unsigned long num_blocks, unsigned long block_size,
+		       SDBackend backend) {
+  SoftwareDisk sd;
+
+  sderror=SD_NONE;
+  sd=new_disk(path, backend);
+  if (! sd) {
+    return NULL;
+  }
+  if (! sd_set_geometry(sd, num_blocks, block_size) || ! sd_init(sd)) {
+    close_backing_store(sd);
+    free(sd);
+    return NULL;
+  }
+  return sd;
+}
+
+// syncs and closes 'sd' and frees the handle; the blocks of an
+// SD_BACKEND_RAM disk are discarded.  The default software disk is only
+// closed, it reopens on the next access.  Returns 1 if the final sync
+// succeeded, otherwise 0.  Always sets global 'sderror'.
+int sd_close(SoftwareDisk sd) {
+  int success;
+
+  success=sd_sync(sd);
+  close_backing_store(sd);
+  if (sd != &default_sd) {
+    free(sd);
+  }
+  return success;
+}
+
+// returns the handle of the default software disk, the one behind the API
+// without a handle
+SoftwareDisk default_software_disk(void) {
+
+  return &default_sd;
+}
+
+//
+// API ON THE DEFAULT SOFTWARE DISK
+//
+
+int init_software_disk() {
+
+  return sd_init(&default_sd);
+}
+
+int set_software_disk_geometry(unsigned long num_blocks, unsigned long block_size) {
+
+  return sd_set_geometry(&default_sd, num_blocks, block_size);
+}
+
+int set_software_disk_format_mode(SDFormatMode mode) {
+
+  return sd_set_format_mode(&default_sd, mode);
+}
+
+unsigned long software_disk_format_time(void) {
+
+  return sd_format_time(&default_sd);
+}
+
+unsigned long software_disk_size() {
+
+  return sd_size(&default_sd);
+}
+
+unsigned long software_disk_block_size() {
+
+  return sd_block_size(&default_sd);
+}
+
+int write_sd_block(void *buf, unsigned long blocknum) {
+
+  return sd_write_block(&default_sd, buf, blocknum);
+}
+
+int read_sd_block(void *buf, unsigned long blocknum) {
+
+  return sd_read_block(&default_sd, buf, blocknum);
+}
+
+int read_sd_blocks(SDBlockIO *ios, unsigned long count) {
+
+  return sd_read_blocks(&default_sd, ios, count);
+}
+
+int write_sd_blocks(SDBlockIO *ios, unsigned long count) {
+
+  return sd_write_blocks(&default_sd, ios, count);
+}
+
+int read_sd_range(void *buf, unsigned long blocknum, unsigned long count) {
+
+  return sd_read_range(&default_sd, buf, blocknum, count);
+}
+
+int write_sd_range(void *buf, unsigned long blocknum, unsigned long count) {
+
+  return sd_write_range(&default_sd, buf, blocknum, count);
+}
+
+int set_software_disk_backend(SDBackend backend) {
+
+  return sd_set_backend(&default_sd, backend);
+}
+
+SDBackend software_disk_backend(void) {
+
+  return sd_backend(&default_sd);
+}
+
+int save_software_disk_snapshot(void) {
+
+  return sd_save_snapshot(&default_sd);
+}
+
+int load_software_disk_snapshot(void) {
+
+  return sd_load_snapshot(&default_sd);
+}
+
+int sync_software_disk(void) {
+
+  return sd_sync(&default_sd);
+}
+
+int set_software_disk_sync_policy(SDSyncPolicy policy, unsigned long group_ops,
+				  unsigned long group_usecs) {
+
+  return sd_set_sync_policy(&default_sd, policy, group_ops, group_usecs);
+}
+
 // describe current software disk error code by printing a descriptive message to
 // standard error.
 void sd_print_error(void) {
@@ -151,5 +997,6 @@ void sd_print_error(void) {
   }
 }
 
-// software disk  error code set (set by each software disk function).
-SDError sderror;
+// software disk  error code set (set by each software disk function), one
+// per thread.
+_Thread_local SDError sderror;
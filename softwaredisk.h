@@ -3,7 +3,14 @@
 // Written by Golden G. Richard III (@nolaforensix), 10/2017.
 //
 
+#ifndef SOFTWAREDISK_H
+#define SOFTWAREDISK_H
+
+// default (and smallest) block size.  The block size of an image is chosen
+// when it is formatted, see set_software_disk_geometry() and
+// software_disk_block_size().
 #define SOFTWARE_DISK_BLOCK_SIZE 512
+#define SOFTWARE_DISK_MAX_BLOCK_SIZE 65536
 
 // software disk error codes
 typedef enum  {
@@ -13,28 +20,179 @@ typedef enum  {
   SD_INTERNAL_ERROR          // the software disk has failed
 } SDError;
 
-// function prototypes for software disk API
+// storage backends for the backing store
+typedef enum {
+  SD_BACKEND_FILE,           // pread/pwrite on the backing store (default)
+  SD_BACKEND_MMAP,           // backing store mapped once, blocks are memory copies
+  SD_BACKEND_RAM             // blocks only in anonymous memory, see the snapshot calls
+} SDBackend;
+
+// when written blocks are made durable with fdatasync()/msync()
+typedef enum {
+  SD_SYNC_NONE,              // only on sync_software_disk() (default)
+  SD_SYNC_EVERY_OP,          // before every write returns
+  SD_SYNC_GROUP              // once per group of writes, see set_software_disk_sync_policy()
+} SDSyncPolicy;
+
+// how init_software_disk() zeroes the backing store
+typedef enum {
+  SD_FORMAT_FAST,            // size the backing store with ftruncate/fallocate (default)
+  SD_FORMAT_SECURE           // write a zeroed block over every block
+} SDFormatMode;
+
+// one block of a vectored transfer: block 'blocknum' moves to/from 'buf',
+// which must be of size software_disk_block_size()
+typedef struct SDBlockIO {
+  unsigned long blocknum;
+  void *buf;
+} SDBlockIO;
+
+// handle of a software disk opened with sd_open() or sd_format().  A
+// handle may be used from any thread, but from one thread at a time.
+typedef struct SoftwareDiskInternals *SoftwareDisk;
+
+// function prototypes for software disk API.  These operate on the default
+// software disk, backed by "sdprivate.sd"; each has an sd_ counterpart
+// below taking a handle.
 
 // initializes the software disk to all zeros, destroying any existing
-// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
+// data.  The geometry is the one last passed to set_software_disk_geometry(),
+// recorded in a header in front of block 0.  Returns 1 on success, otherwise 0.
+// Always sets global 'sderror'.
 int init_software_disk();
 
-// returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
+// sets the geometry used by subsequent init_software_disk() calls (default
+// 5000 blocks of SOFTWARE_DISK_BLOCK_SIZE bytes).  'block_size' must be a power
+// of two between SOFTWARE_DISK_BLOCK_SIZE and SOFTWARE_DISK_MAX_BLOCK_SIZE.
+// Returns 1 on success, otherwise 0.  Always sets global 'sderror'.
+int set_software_disk_geometry(unsigned long num_blocks, unsigned long block_size);
+
+// selects how subsequent init_software_disk() calls zero the backing store.
+// Returns 1 on success, otherwise 0.  Always sets global 'sderror'.
+int set_software_disk_format_mode(SDFormatMode mode);
+
+// returns the time taken by the last init_software_disk(), in microseconds
+unsigned long software_disk_format_time(void);
+
+// returns the size of the SoftwareDisk in blocks, or 0 if there is no
+// usable software disk
 unsigned long software_disk_size();
 
+// returns the block size of the SoftwareDisk in bytes, or 0 if there is no
+// usable software disk
+unsigned long software_disk_block_size();
+
 // writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
-// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// from 0.  The buffer 'buf' must be of size software_disk_block_size().  Returns 1
 // on success or 0 on failure.  Always sets global 'sderror'.
 int write_sd_block(void *buf, unsigned long blocknum);
 
 // reads a block of data into 'buf' from location 'blocknum'.  Blocks are numbered 
-// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// from 0.  The buffer 'buf' must be of size software_disk_block_size().  Returns 1
 // on success or 0 on failure.  Always sets global 'sderror'.
 int read_sd_block(void *buf, unsigned long blocknum);
 
+// reads 'count' blocks, block ios[i].blocknum into ios[i].buf.  Runs of
+// consecutive block numbers are transferred with a single preadv().
+// Returns 1 on success or 0 on failure.  Always sets global 'sderror'.
+int read_sd_blocks(SDBlockIO *ios, unsigned long count);
+
+// writes 'count' blocks, ios[i].buf to block ios[i].blocknum.  Runs of
+// consecutive block numbers are transferred with a single pwritev().
+// Returns 1 on success or 0 on failure.  Always sets global 'sderror'.
+int write_sd_blocks(SDBlockIO *ios, unsigned long count);
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf', which
+// must be of size count * software_disk_block_size().  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int read_sd_range(void *buf, unsigned long blocknum, unsigned long count);
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf', which
+// must be of size count * software_disk_block_size().  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int write_sd_range(void *buf, unsigned long blocknum, unsigned long count);
+
+// selects the backend for the backing store.  An open backing store is
+// synced and closed first, the blocks of an SD_BACKEND_RAM disk are
+// discarded.  Without a call the SOFTWARE_DISK_BACKEND environment variable
+// ("file", "mmap" or "ram") picks the backend.  Returns 1 on success,
+// otherwise 0.  Always sets global 'sderror'.
+int set_software_disk_backend(SDBackend backend);
+
+// returns the backend of the software disk
+SDBackend software_disk_backend(void);
+
+// writes an SD_BACKEND_RAM disk to the backing store, in the same format
+// init_software_disk() produces; only syncs for the other backends.  Returns
+// 1 on success or 0 on failure.  Always sets global 'sderror'.
+int save_software_disk_snapshot(void);
+
+// loads the image in the backing store, geometry included, into an
+// SD_BACKEND_RAM disk; only reopens the backing store for the other
+// backends.  Returns 1 on success or 0 on failure.  Always sets global
+// 'sderror'.
+int load_software_disk_snapshot(void);
+
+// makes all blocks written since the last sync durable (fdatasync, or msync
+// of the dirty ranges for SD_BACKEND_MMAP).  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int sync_software_disk(void);
+
+// selects when written blocks are made durable.  With SD_SYNC_GROUP one sync
+// covers up to 'group_ops' writes, or the writes of 'group_usecs'
+// microseconds, whichever comes first (defaults 64 writes, 10 ms; 0 keeps the
+// current value).  Pending writes are synced first.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int set_software_disk_sync_policy(SDSyncPolicy policy, unsigned long group_ops,
+				  unsigned long group_usecs);
+
+// function prototypes for the software disk API on handles
+
+// opens the existing image 'path' with 'backend', loading it into memory for
+// SD_BACKEND_RAM.  Returns the handle, or NULL on failure.  Always sets
+// global 'sderror'.
+SoftwareDisk sd_open(char *path, SDBackend backend);
+
+// formats a new image of 'num_blocks' blocks of 'block_size' bytes at 'path',
+// destroying any existing one.  For SD_BACKEND_RAM 'path' is only used by
+// the snapshot calls.  Returns the handle, or NULL on failure.  Always sets
+// global 'sderror'.
+SoftwareDisk sd_format(char *path, unsigned long num_blocks, unsigned long block_size,
+		       SDBackend backend);
+
+// syncs and closes 'sd' and frees the handle.  Returns 1 if the final sync
+// succeeded, otherwise 0.  Always sets global 'sderror'.
+int sd_close(SoftwareDisk sd);
+
+// returns the handle of the default software disk
+SoftwareDisk default_software_disk(void);
+
+int sd_init(SoftwareDisk sd);
+int sd_set_geometry(SoftwareDisk sd, unsigned long num_blocks, unsigned long block_size);
+int sd_set_format_mode(SoftwareDisk sd, SDFormatMode mode);
+unsigned long sd_format_time(SoftwareDisk sd);
+unsigned long sd_size(SoftwareDisk sd);
+unsigned long sd_block_size(SoftwareDisk sd);
+int sd_write_block(SoftwareDisk sd, void *buf, unsigned long blocknum);
+int sd_read_block(SoftwareDisk sd, void *buf, unsigned long blocknum);
+int sd_read_blocks(SoftwareDisk sd, SDBlockIO *ios, unsigned long count);
+int sd_write_blocks(SoftwareDisk sd, SDBlockIO *ios, unsigned long count);
+int sd_read_range(SoftwareDisk sd, void *buf, unsigned long blocknum, unsigned long count);
+int sd_write_range(SoftwareDisk sd, void *buf, unsigned long blocknum, unsigned long count);
+int sd_set_backend(SoftwareDisk sd, SDBackend backend);
+SDBackend sd_backend(SoftwareDisk sd);
+int sd_save_snapshot(SoftwareDisk sd);
+int sd_load_snapshot(SoftwareDisk sd);
+int sd_sync(SoftwareDisk sd);
+int sd_set_sync_policy(SoftwareDisk sd, SDSyncPolicy policy, unsigned long group_ops,
+		       unsigned long group_usecs);
+
 // describe current software disk error code by printing a descriptive message to
 // standard error.
 void sd_print_error(void);
 
-// software disk  error code set (set by each software disk function).
-extern SDError sderror;
+// software disk  error code set (set by each software disk function), one
+// per thread.
+extern _Thread_local SDError sderror;
+
+#endif